@@ -0,0 +1,176 @@
+#include "../examples.h"
+
+/*
+CKKS 封装的微基准测试，独立于 main.cpp 编译为单独的可执行文件（bench/benchmark.cpp + utils.cpp，单独的工程），
+有自己的 main，放在 bench/ 下，不会被根目录的 *.cpp 与 main.cpp 一起编译。
+对每组参数（poly_modulus_degree / coeff_modulus）测量每个封装操作：先预热，再按预热得到的单次耗时
+自适应地决定迭代次数，输出 p50/p95/p99 延迟（ms）和吞吐（次/秒），结果同时写成 JSON 便于在版本之间对比。
+用法：benchmark [输出 JSON 路径] [每个操作的最短测量时间（ms）]
+*/
+
+struct BenchResult {
+    string params;
+    string op;
+    size_t iterations = 0;
+    double mean = 0;
+    double stddev = 0;
+    double min = 0;
+    double max = 0;
+    double p50 = 0;
+    double p95 = 0;
+    double p99 = 0;
+    double throughput = 0;
+};
+
+// 最近秩法的百分位数，samples 已排序
+static double percentile(const vector<double>& samples, double p) {
+    size_t rank = static_cast<size_t>(ceil(p / 100 * samples.size()));
+    return samples[min(samples.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+/*
+prepare 在每次迭代前执行且不计时（如复制会被原地修改的密文），op 为被测操作。
+预热至少 3 次且至少 min_time / 10，之后迭代次数取 min_time / 预热的单次耗时，限制在 [min_iter, max_iter] 之间
+*/
+static BenchResult runBench(const string& params, const string& op_name, const function<void()>& prepare, const function<void()>& op, double min_time, size_t min_iter = 10, size_t max_iter = 100000) {
+    double warm_time = 0;
+    size_t warm_iter = 0;
+    while (warm_iter < 3 || warm_time < min_time / 10) {
+        prepare();
+        long long start = getClockTime();
+        op();
+        warm_time += static_cast<double>(getClockTime() - start) / 1000000;
+        warm_iter++;
+    }
+    double estimate = max(warm_time / warm_iter, 1e-6);
+    size_t iterations = min(max_iter, max(min_iter, static_cast<size_t>(min_time / estimate)));
+    vector<double> samples;
+    samples.reserve(iterations);
+    for (size_t i = 0; i < iterations; i++) {
+        prepare();
+        long long start = getClockTime();
+        op();
+        samples.push_back(static_cast<double>(getClockTime() - start) / 1000000);
+    }
+    sort(samples.begin(), samples.end());
+    BenchResult result;
+    result.params = params;
+    result.op = op_name;
+    result.iterations = iterations;
+    result.mean = add_self(samples) / iterations;
+    double variance = 0;
+    for (double sample : samples) {
+        variance += (sample - result.mean) * (sample - result.mean);
+    }
+    result.stddev = sqrt(variance / iterations);
+    result.min = samples.front();
+    result.max = samples.back();
+    result.p50 = percentile(samples, 50);
+    result.p95 = percentile(samples, 95);
+    result.p99 = percentile(samples, 99);
+    result.throughput = 1000 / result.mean;
+    return result;
+}
+// 返回 false 表示并发 dot 的结果与单线程不一致
+static bool benchParams(const ParamPreset& preset, double min_time, vector<BenchResult>& results) {
+    size_t slot_count = preset.slots();
+    // dot、replicate 和单步旋转用到的全部步长
+    vector<int> steps = CKKS::batchRotationSteps(slot_count);
+    CKKS cryptor(CKKS::presetParameters(preset), preset.scale(), steps);
+    const string& name = preset.name;
+    auto add_result = [&](const BenchResult& result) {
+        results.push_back(result);
+        cout << "   | " << setw(12) << name << setw(18) << result.op << "  p50 " << result.p50 << "ms  p95 " << result.p95
+            << "ms  p99 " << result.p99 << "ms  " << result.throughput << " op/s (" << result.iterations << " iterations)" << endl;
+    };
+    auto nothing = []() {};
+
+    vector<double> input(slot_count);
+    for (size_t i = 0; i < slot_count; i++) {
+        input[i] = static_cast<double>(i) / slot_count;
+    }
+    Plaintext plain;
+    Ciphertext cipher, other, result, work;
+    vector<double> values;
+    cryptor.encrypt(input, cipher);
+    cryptor.encrypt(input, other);
+    // 第一次使用时才生成重线性化密钥和 Galois 密钥，先生成，避免计入第一个操作的耗时
+    cryptor.relinKeys();
+    cryptor.galoisKeys();
+    // 计时之前先确认多个线程共享 cryptor 并发计算 dot 的结果正确
+    if (!verifyConcurrentDot(cryptor, cipher)) {
+        cerr << "Error: " << name << " concurrent dot does not match the single-threaded result" << endl;
+        return false;
+    }
+    cout << "   | " << setw(12) << name << "  concurrent dot: passed" << endl;
+    Evaluator evaluator(cryptor.getContext());
+    Ciphertext product;
+    evaluator.multiply(cipher, other, product);
+
+    add_result(runBench(name, "encode", nothing, [&]() { cryptor.encode(input, plain); }, min_time));
+    add_result(runBench(name, "encodePlain", nothing, [&]() { cryptor.encodePlain(input, plain); }, min_time));
+    add_result(runBench(name, "encrypt", nothing, [&]() { cryptor.encrypt(input, result); }, min_time));
+    add_result(runBench(name, "decrypt", nothing, [&]() { cryptor.decrypt(cipher, values); }, min_time));
+    add_result(runBench(name, "add", nothing, [&]() { cryptor.add(cipher, other, result); }, min_time));
+    add_result(runBench(name, "multiply", nothing, [&]() { evaluator.multiply(cipher, other, result); }, min_time));
+    add_result(runBench(name, "relinearize", [&]() { work = product; }, [&]() { evaluator.relinearize_inplace(work, cryptor.relinKeys()); }, min_time));
+    add_result(runBench(name, "rescale", [&]() { work = cipher; }, [&]() { evaluator.rescale_to_next_inplace(work); }, min_time));
+    add_result(runBench(name, "rotate", nothing, [&]() { evaluator.rotate_vector(cipher, 1, cryptor.galoisKeys(), result); }, min_time));
+    add_result(runBench(name, "modSwitchTo", nothing, [&]() { cryptor.modSwitchTo(cipher, cryptor.lowestParmsId(), result); }, min_time));
+    add_result(runBench(name, "square", nothing, [&]() { cryptor.square(cipher, result); }, min_time));
+    add_result(runBench(name, "mul_vector", nothing, [&]() { cryptor.mul_vector(cipher, other, result); }, min_time));
+    add_result(runBench(name, "dot", nothing, [&]() { cryptor.dot(cipher, other, result); }, min_time));
+    add_result(runBench(name, "sumSlots", [&]() { work = cipher; }, [&]() { cryptor.sumSlots(work, slot_count); }, min_time));
+    add_result(runBench(name, "selfDot", nothing, [&]() { cryptor.selfDot(cipher); }, min_time));
+    add_result(runBench(name, "cosineSimilarity", nothing, [&]() { cryptor.cosineSimilarity(cipher, other, 1, 1); }, min_time));
+    vector<Ciphertext> image = { cipher, cipher, cipher };
+    add_result(runBench(name, "imageSimilarity", nothing, [&]() { cryptor.imageSimilarity(image, image, 1, 1); }, min_time));
+    add_result(runBench(name, "replicate", nothing, [&]() { cryptor.replicate(cipher, slot_count / 4, result); }, min_time));
+
+    // 序列化：在内存中进行，不包含磁盘 I/O
+    for (auto& mode : vector<pair<string, compr_mode_type>>{ { "none", compr_mode_type::none }, { "zstd", compr_mode_type::zstd } }) {
+        stringstream buffer;
+        add_result(runBench(name, "save/" + mode.first, [&]() { buffer.str(""); }, [&]() { cipher.save(buffer, mode.second); }, min_time));
+        buffer.str("");
+        cipher.save(buffer, mode.second);
+        string bytes = buffer.str();
+        add_result(runBench(name, "load/" + mode.first, nothing, [&]() {
+            cryptor.loadCiphertext(reinterpret_cast<const seal_byte*>(bytes.data()), bytes.size(), result);
+        }, min_time));
+    }
+    stringstream seeded;
+    CipherFormat format{ true, compr_mode_type::zstd };
+    add_result(runBench(name, "encryptTo/seeded", [&]() { seeded.str(""); }, [&]() { cryptor.encryptTo(input, seeded, format); }, min_time));
+    return true;
+}
+static void writeJson(const string& path, const vector<BenchResult>& results) {
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Unable to open the file for writing: " << path << endl;
+        return;
+    }
+    out << setprecision(9);
+    out << "{\n  \"unit\": \"ms\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "    { \"params\": \"" << r.params << "\", \"op\": \"" << r.op << "\", \"iterations\": " << r.iterations
+            << ", \"mean\": " << r.mean << ", \"stddev\": " << r.stddev << ", \"min\": " << r.min << ", \"max\": " << r.max
+            << ", \"p50\": " << r.p50 << ", \"p95\": " << r.p95 << ", \"p99\": " << r.p99
+            << ", \"throughput\": " << r.throughput << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+int main(int argc, char* argv[]) {
+    string json_path = argc > 1 ? argv[1] : "benchmark.json";
+    double min_time = argc > 2 ? atof(argv[2]) : 200;
+    vector<BenchResult> results;
+    cout << fixed << setprecision(4);
+    cout << "   /" << endl;
+    bool ok = true;
+    for (const ParamPreset& preset : CKKS::presets()) {
+        ok = benchParams(preset, min_time, results) && ok;
+    }
+    cout << "   \\" << endl;
+    writeJson(json_path, results);
+    cout << "results written to " << json_path << endl;
+    return ok ? 0 : 1;
+}
@@ -5,12 +5,18 @@
 
 #include "seal/seal.h"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
@@ -18,6 +24,7 @@
 #include <sstream>
 #include <string.h>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <opencv2/opencv.hpp>
 #include <string>
@@ -37,7 +44,14 @@ void mul(const vector<double>& vector_1, const vector<double>& vector_2, vector<
 double add_self(const vector<double>& vector);
 bool isImage(string path);
 void getImagePath(const string& dir, vector<string>& imagePaths);
-void getImageVector(const string& str, vector<vector<double>>& result);
+// max_pixels 为一个密文能放下的像素数，一般为 CKKS::getSlot()，更大的图像返回空结果（改用 enc_image_tiled 分块）
+void getImageVector(const string& str, vector<vector<double>>& result, size_t max_pixels = 4096);
+void getImageVector(const Mat& image, vector<vector<double>>& result);
+void deinterleavePixels(const uchar* src, size_t count, size_t channel, double* const* dst);
+bool deinterleaveImage(const Mat& image, double* const* dst);
+bool forEachImageTile(const Mat& image, size_t tile_size, const function<void(size_t tile, size_t channel, const vector<double>& pixels)>& visit);
+bool forEachImageTile(const string& str, size_t tile_size, const function<void(size_t tile, size_t channel, const vector<double>& pixels)>& visit);
+bool getImageTile(const Mat& image, size_t tile_size, size_t tile, vector<vector<double>>& result);
 void getFilePath(const string& dir, vector<string>& Paths);
 void getSubDir(const string& dir, vector<string>& Paths);
 bool equalImage(const string& str1, const string& str2);
@@ -45,6 +59,12 @@ bool equalImage(const vector<vector<double>>& image1, const vector<vector<double
 bool equalImage(const string& str, const vector<vector<double>>& input);
 long long getClockTime();
 /*
+整幅图像余弦相似度的匹配阈值。旧的目录版 search 要求各通道余弦之积超过 0.9999，即各通道的 (1 - cos) 之和不超过 1e-4；
+整幅图像的余弦相似度满足 1 - cos ≈ Σ w_c (1 - cos_c)，w_c 为第 c 个通道的能量占比，三个通道能量相当时取 1 - 1e-4 / 3 与旧的判定一致。
+能量占比为 w 的通道允许的偏差放宽为 (1 - 阈值) / w，暗通道上的差异更难被发现；具体数据上可以用 tools/tuner.cpp 重新标定
+*/
+const double image_similarity_threshold = 0.99997;
+/*
 Helper function: Prints the name of the example in a fancy banner.
 */
 inline void print_example_banner(std::string title)
@@ -239,56 +259,519 @@ inline std::string uint64_to_hex_string(std::uint64_t value)
 }
 
 
+/*
+密文入库时的序列化方式：
+seeded —— 使用私钥对称加密，密文的第二个多项式由随机种子代替，序列化后大小约为原来的一半，载入时由 SEAL 自动展开；
+compr_mode —— SEAL 序列化的压缩方式（none/zlib/zstd），也用于 savePublic/savePrivate 保存密钥；
+lowest_level —— 通道密文直接编码在相似度计算（一次乘法）仍可用的最低层级，范数密文只用于解密，编码在最后一层，
+               RNS 分量更少，文件更小，每个候选的乘法、重线性化和旋转也更快；
+               分块的大图像按 CKKS::imageParmsId 保存在高一层，使 rescale 后剩余的模数放得下整幅图像的槽位求和
+*/
+struct CipherFormat {
+	bool seeded = false;
+	compr_mode_type compr_mode = Serialization::compr_mode_default;
+	bool lowest_level = false;
+};
+
+/*
+加密参数预设：slots() 为槽位数，depth() 为可用的乘法深度（coeff_modulus 去掉首尾两个素数后的个数）。
+N4096 的系数模数总位数不能超过 109，尺度只能取 2^20，精度低于另外两组，但每个操作快数倍
+*/
+struct ParamPreset {
+	string name;
+	size_t poly_modulus_degree;
+	vector<int> coeff_modulus;
+	int scale_bits;
+	size_t slots() const {
+		return poly_modulus_degree / 2;
+	}
+	size_t depth() const {
+		return coeff_modulus.size() - 2;
+	}
+	double scale() const {
+		return pow(2.0, scale_bits);
+	}
+};
+
+// 计时的热点操作，deserialize 为密文反序列化（含从文件读取）
+enum class MetricOp { encode, decode, encrypt, decrypt, multiply, multiply_plain, relinearize, rescale, rotate, mod_switch, deserialize, count };
+// 累加计数：载入的密文字节数、打分的候选数、检索的查询数
+enum class MetricCounter { bytes_loaded, candidates, queries, count };
+
+/*
+以 2 为底的对数分桶直方图，第 b 个桶统计位数为 b 的取值，即 [2^(b-1), 2^b)，第 0 个桶统计 0。
+record 只做几次 relaxed 原子加，可以被多个线程同时调用；分位数取所在桶的上界，是近似值
+*/
+class Histogram {
+public:
+	static const size_t bucket_count = 48;
+	void record(uint64_t value) {
+		size_t bucket = 0;
+		while (bucket + 1 < bucket_count && (value >> bucket) != 0) {
+			bucket++;
+		}
+		buckets[bucket].fetch_add(1, memory_order_relaxed);
+		samples.fetch_add(1, memory_order_relaxed);
+		total.fetch_add(value, memory_order_relaxed);
+	}
+	uint64_t count() const {
+		return samples.load(memory_order_relaxed);
+	}
+	uint64_t sum() const {
+		return total.load(memory_order_relaxed);
+	}
+	uint64_t percentile(double p) const;
+	void reset();
+private:
+	atomic<uint64_t> buckets[bucket_count]{};
+	atomic<uint64_t> samples{ 0 };
+	atomic<uint64_t> total{ 0 };
+};
+
+// Chrome trace 的一个完整事件（ph 为 X），start、duration 单位为 ns，args 为 JSON 对象的成员列表
+struct TraceEvent {
+	string name;
+	long long start;
+	long long duration;
+	size_t thread;
+	string args;
+};
+
+/*
+进程内的指标：每个 MetricOp 的耗时直方图（ns）、MetricCounter 计数、每次检索打分的候选数直方图，以及可选的 trace 事件。
+默认关闭，关闭时每个埋点只多一次 relaxed 原子读和一次分支，不读时钟；enable(true, true) 同时记录 trace，
+writeTrace 输出 Chrome trace（chrome://tracing 或 Perfetto 打开），writeJson 输出汇总，report 打印到控制台
+*/
+class Metrics {
+public:
+	static Metrics& instance() {
+		static Metrics metrics;
+		return metrics;
+	}
+	bool enabled() const {
+		return metrics_enabled.load(memory_order_relaxed);
+	}
+	bool tracing() const {
+		return trace_enabled.load(memory_order_relaxed);
+	}
+	void enable(bool metrics = true, bool trace = false);
+	void record(MetricOp op, long long ns) {
+		ops[static_cast<size_t>(op)].record(static_cast<uint64_t>(max(ns, 0LL)));
+	}
+	void add(MetricCounter counter, uint64_t value) {
+		if (enabled()) {
+			counters[static_cast<size_t>(counter)].fetch_add(value, memory_order_relaxed);
+		}
+	}
+	// 一次检索结束时调用，candidates 为实际打分的候选数
+	void recordQuery(size_t candidates) {
+		if (enabled()) {
+			counters[static_cast<size_t>(MetricCounter::queries)].fetch_add(1, memory_order_relaxed);
+			counters[static_cast<size_t>(MetricCounter::candidates)].fetch_add(candidates, memory_order_relaxed);
+			candidates_per_query.record(candidates);
+		}
+	}
+	void span(const string& name, long long start, long long end, const string& args = "");
+	const Histogram& histogram(MetricOp op) const {
+		return ops[static_cast<size_t>(op)];
+	}
+	uint64_t counter(MetricCounter counter) const {
+		return counters[static_cast<size_t>(counter)].load(memory_order_relaxed);
+	}
+	const Histogram& candidatesPerQuery() const {
+		return candidates_per_query;
+	}
+	void reset();
+	void report(ostream& out) const;
+	bool writeJson(const string& path) const;
+	bool writeTrace(const string& path) const;
+	static const char* name(MetricOp op);
+	static const char* name(MetricCounter counter);
+	// trace 事件数的上限，超过后丢弃并计数，避免长时间运行时无限增长
+	static const size_t max_trace_events = 1 << 20;
+private:
+	Metrics() = default;
+	atomic<bool> metrics_enabled{ false };
+	atomic<bool> trace_enabled{ false };
+	Histogram ops[static_cast<size_t>(MetricOp::count)];
+	atomic<uint64_t> counters[static_cast<size_t>(MetricCounter::count)]{};
+	Histogram candidates_per_query;
+	mutable mutex trace_mutex;
+	vector<TraceEvent> events;
+	size_t dropped_events = 0;
+	long long trace_origin = 0;
+};
+
+// 作用域计时：构造时指标已开启才读时钟，析构时记入 op 的直方图
+class MetricTimer {
+public:
+	explicit MetricTimer(MetricOp _op) :op(_op), start(Metrics::instance().enabled() ? getClockTime() : 0) {
+	}
+	~MetricTimer() {
+		if (start != 0) {
+			Metrics::instance().record(op, getClockTime() - start);
+		}
+	}
+	MetricTimer(const MetricTimer&) = delete;
+	MetricTimer& operator=(const MetricTimer&) = delete;
+private:
+	MetricOp op;
+	long long start;
+};
+
+// 作用域 trace 事件：只有 trace 开启时才记录，arg 附加的参数显示在 Chrome trace 的 args 中
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* _name) :name(_name), start(Metrics::instance().tracing() ? getClockTime() : 0) {
+	}
+	~TraceSpan() {
+		if (start != 0) {
+			Metrics::instance().span(name, start, getClockTime(), args);
+		}
+	}
+	void arg(const char* key, double value) {
+		if (start != 0) {
+			ostringstream out;
+			out << (args.empty() ? "" : ", ") << "\"" << key << "\": " << value;
+			args += out.str();
+		}
+	}
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+	const char* name;
+	long long start;
+	string args;
+};
+
+/*
+一次检索的埋点：记录名为 name 的 trace 事件，结束时把 candidates（实际打分的候选数）记入 Metrics::recordQuery
+*/
+class QueryMetrics {
+public:
+	explicit QueryMetrics(const char* name) :span(name) {
+	}
+	~QueryMetrics() {
+		span.arg("candidates", static_cast<double>(candidates));
+		Metrics::instance().recordQuery(candidates);
+	}
+	size_t candidates = 0;
+private:
+	TraceSpan span;
+};
+
+// CKKS::Circuit 一次 run 实际执行的操作数，reused 为构图时被去重的 add/mul/rotate 个数（重复 input 同一个密文不计入）
+struct CircuitStats {
+	size_t nodes = 0;
+	size_t reused = 0;
+	size_t multiplies = 0;
+	size_t relinearizations = 0;
+	size_t rescales = 0;
+	size_t rotations = 0;
+	size_t mod_switches = 0;
+};
+
+/*
+CKKS 的加解密与同态计算接口均为 const，且不会修改输入密文：层级不一致时只在临时密文上做 mod switch。
+SEAL 的 Encryptor/Evaluator/Decryptor 和 CKKSEncoder 在只读使用时是线程安全的，
+因此多个线程可以共享同一个 CKKS（以及其 SEALContext）和同一份库内密文并发调用这些接口；
+只有 loadPrivate 这类替换密钥的操作需要与其它调用互斥。
+*/
 class CKKS {
 public:
-	CKKS(const EncryptionParameters& params = defaultEncryptionParameters(), const double& _scale = pow(2.0, 40))
-		:parms(params), context(params), scale(_scale), keyGen(context), encoder(context), secret_key(keyGen.secret_key()), public_key(), relin_keys(), gal_keys() {
-		keyGen.create_public_key(public_key);
-		keyGen.create_relin_keys(relin_keys);
-		keyGen.create_galois_keys(gal_keys);
+	/*
+	同态计算的临时对象：对齐用的密文、乘积、旋转结果以及解密用的明文和槽位向量都从 pool 分配，并在多次调用之间复用，
+	SEAL 内部的临时内存也从 pool 分配；pool 中释放的内存会被重复使用，稳态下每个候选不再有新的堆分配。
+	pool 由调用方提供，同一个 Scratch 同一时间只能被一个线程使用
+	*/
+	struct Scratch {
+		explicit Scratch(MemoryPoolHandle _pool = MemoryPoolHandle::New())
+			:pool(_pool), aligned(_pool), product(_pool), rotated(_pool), result(_pool), plain(_pool) {
+		}
+		// pool 累计分配的字节数，稳态下不再增长
+		size_t allocatedBytes() const {
+			return pool.alloc_byte_count();
+		}
+		MemoryPoolHandle pool;
+		Ciphertext aligned;
+		Ciphertext product;
+		Ciphertext rotated;
+		Ciphertext result;
+		Plaintext plain;
+		vector<double> values;
+	};
+	/*
+	每个搜索线程独立持有的 Evaluator/Decryptor，与所属 CKKS 共享 SEALContext、编码器和密钥。
+	不修改输入密文，层级不一致时在临时密文上对齐，因此多个线程可以同时读取同一份库内密文。
+	*/
+	class Worker {
+	public:
+		// pool 为该线程所有临时对象使用的内存池，默认为 Worker 独占的新内存池
+		explicit Worker(const CKKS& _owner, MemoryPoolHandle pool = MemoryPoolHandle::New())
+			:owner(_owner), evaluator(_owner.context), decryptor(_owner.context, _owner.secret_key), scratch(pool) {
+		}
+		void dot(const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result) {
+			owner.dot(evaluator, cipher_1, cipher_2, result, 0, scratch);
+		}
+		void decrypt(const Ciphertext& cipher, vector<double>& result) {
+			{
+				MetricTimer timer(MetricOp::decrypt);
+				decryptor.decrypt(cipher, scratch.plain);
+			}
+			MetricTimer timer(MetricOp::decode);
+			owner.encoder.decode(scratch.plain, result, scratch.pool);
+		}
+		double cosineSimilarity(const Ciphertext& cipher1, const Ciphertext& cipher2, double norm1, double norm2) {
+			dot(cipher1, cipher2, scratch.result);
+			decrypt(scratch.result, scratch.values);
+			return scratch.values[0] / sqrt(norm1 * norm2);
+		}
+		double imageSimilarity(const vector<Ciphertext>& ciphers1, const vector<Ciphertext>& ciphers2, double norm1, double norm2, size_t span = 0) {
+			owner.dotImage(evaluator, ciphers1, ciphers2, scratch.result, span, scratch);
+			decrypt(scratch.result, scratch.values);
+			return scratch.values[0] / sqrt(norm1 * norm2);
+		}
+		size_t allocatedBytes() const {
+			return scratch.allocatedBytes();
+		}
+	private:
+		const CKKS& owner;
+		Evaluator evaluator;
+		Decryptor decryptor;
+		Scratch scratch;
+	};
+	/*
+	延迟求值的同态电路：add/mul/rotate/sum 只构建表达式图，run 时先规划再执行。
+	构图时按 (操作, 操作数, 步长) 去重，相同的子表达式（如每个候选都要算的 dot(q, q)）只计算一次；
+	乘积不立即重线性化和 rescale，直到被旋转、再次相乘或作为输出时才做，多个乘积相加后只做一次；
+	执行前推算每个节点的层级，操作数层级不一致时把较高的一方切换到较低层级，每个 (节点, 层级) 只切换一次；
+	同时推算每个节点的尺度，add 的两个操作数尺度不同（如在不同层级 rescale 的两个值）时规划失败，不会修改尺度强行相加。
+	输入密文以指针保存，run 结束前调用方需保证其有效；rotate 的步长需要有对应的 Galois 密钥。
+	同一个 Circuit 同一时间只能被一个线程使用
+	*/
+	class Circuit {
+	public:
+		typedef size_t Node;
+		explicit Circuit(const CKKS& _owner) :owner(_owner) {
+		}
+		Node input(const Ciphertext& cipher);
+		Node add(Node a, Node b);
+		Node mul(Node a, Node b);
+		Node rotate(Node a, int step);
+		// 对每个长度为 span（2 的幂）的块旋转求和，0 表示全部槽位
+		Node sum(Node a, size_t span = 0);
+		Node dot(Node a, Node b, size_t span = 0) {
+			return sum(mul(a, b), span);
+		}
+		// 计算 outputs 的值，结果均已重线性化和 rescale；层级无法满足（需要 rescale 但已在最低层级）或相加的尺度不同时返回 false
+		bool run(const vector<Node>& outputs, vector<Ciphertext>& results);
+		const CircuitStats& getStats() const {
+			return stats;
+		}
+		size_t size() const {
+			return exprs.size();
+		}
+	private:
+		enum class Op { input, add, mul, rotate };
+		struct Expr {
+			Op op;
+			Node lhs;
+			Node rhs;
+			int step;
+			const Ciphertext* cipher;
+		};
+		// 执行期每个节点的值：raw 为刚算出的结果（乘积为 size 3、尺度为平方），final 为重线性化并 rescale 后的结果，
+		// switched[f][level] 为切换到 level 的 raw（f = 0）或 final（f = 1）
+		struct Value {
+			Ciphertext raw;
+			Ciphertext final;
+			bool has_final = false;
+			map<size_t, Ciphertext> switched[2];
+		};
+		Node intern(const Expr& expr);
+		bool plan(const vector<Node>& outputs);
+		const Ciphertext& base(Node node, bool final);
+		const Ciphertext& fetch(Node node, bool final, size_t level);
+		void execute(Node node);
+		size_t finalLevel(Node node) const {
+			return pending[node] ? levels[node] - 1 : levels[node];
+		}
+		double finalScale(Node node) const;
+		const CKKS& owner;
+		vector<Expr> exprs;
+		map<tuple<int, Node, Node, int>, Node> interned;
+		map<const Ciphertext*, Node> inputs;
+		// 规划结果：levels 为 raw 的层级（chain_index），scales 为 raw 的尺度，pending 表示尚待 rescale，uses 为剩余的使用次数
+		vector<size_t> levels;
+		vector<double> scales;
+		vector<char> pending;
+		vector<char> needed;
+		vector<size_t> uses;
+		vector<Value> values;
+		vector<parms_id_type> parms_ids;
+		CircuitStats stats;
+	};
+
+	/*
+	rotation_steps 为需要生成 Galois 密钥的旋转步长，为空时只生成 dot/sumSlots 用到的 1, 2, 4, ..., slot_count/2；
+	replicate/extract（批量打分）还要用到负步长，由 batchGaloisKeys 在第一次用到时另外生成，也可以直接写进 rotation_steps 或 setRotationSteps。
+	重线性化密钥和 Galois 密钥在第一次用到时才生成（或从 loadPrivate 指定的目录载入）。
+	*/
+	CKKS(const EncryptionParameters& params = defaultEncryptionParameters(), const double& _scale = pow(2.0, 40), const vector<int>& _rotation_steps = {})
+		:parms(params), context(params), scale(_scale), keyGen(make_unique<KeyGenerator>(context)), encoder(context), secret_key(keyGen->secret_key()), public_key(), relin_keys(), gal_keys() {
+		keyGen->create_public_key(public_key);
 
-		encryptor = make_unique<Encryptor>(context, public_key);
+		encryptor = make_unique<Encryptor>(context, public_key, secret_key);
 		evaluator = make_unique<Evaluator>(context);
 		decryptor = make_unique<Decryptor>(context, secret_key);
 
 		slot_count = encoder.slot_count();
+		rotation_steps = _rotation_steps.empty() ? rotationSteps(slot_count) : _rotation_steps;
+	}
+	/*
+	快速构造：只构造 SEALContext 和编码器，不生成任何密钥，必须随后调用 loadPrivate 才能加解密和计算。
+	用于密钥已经保存在磁盘上的场景，省去生成私钥、公钥等一整套密钥的时间。
+	*/
+	struct NoKeys {};
+	CKKS(NoKeys, const EncryptionParameters& params = defaultEncryptionParameters(), const double& _scale = pow(2.0, 40))
+		:parms(params), scale(_scale), context(params), encoder(context) {
+		evaluator = make_unique<Evaluator>(context);
+
+		slot_count = encoder.slot_count();
+		rotation_steps = rotationSteps(slot_count);
+	}
+	// 从 savePrivate 保存的目录（key_dir\\private）直接载入密钥
+	static unique_ptr<CKKS> fromKeys(const string& key_dir, const EncryptionParameters& params = defaultEncryptionParameters(), const double& _scale = pow(2.0, 40)) {
+		auto cryptor = make_unique<CKKS>(NoKeys(), params, _scale);
+		cryptor->loadPrivate(key_dir + "\\private");
+		return cryptor;
 	}
-	double getScale() {
+	static unique_ptr<CKKS> fromKeys(const string& key_dir, const ParamPreset& preset) {
+		return fromKeys(key_dir, presetParameters(preset), preset.scale());
+	}
+	static unique_ptr<CKKS> fromPreset(const ParamPreset& preset, const vector<int>& _rotation_steps = {}) {
+		return make_unique<CKKS>(presetParameters(preset), preset.scale(), _rotation_steps);
+	}
+	// 使用 key_dir\\<预设名> 下保存的密钥，还没有时按预设生成一套并保存；不同预设的密钥分目录保存，互不覆盖
+	static unique_ptr<CKKS> fromPresetKeys(const string& key_dir, const ParamPreset& preset) {
+		string dir = key_dir + "\\" + preset.name;
+		if (exists(dir + "\\private")) {
+			return fromKeys(dir, preset);
+		}
+		unique_ptr<CKKS> cryptor = fromPreset(preset);
+		cryptor->savePrivate(dir);
+		return cryptor;
+	}
+	static const vector<ParamPreset>& presets() {
+		static const vector<ParamPreset> list = {
+			{ "N4096", 4096, { 40, 20, 40 }, 20 },
+			{ "N8192", 8192, { 60, 40, 40, 60 }, 40 },
+			{ "N16384", 16384, { 60, 40, 40, 40, 40, 60 }, 40 },
+		};
+		return list;
+	}
+	static const ParamPreset* findPreset(const string& name) {
+		for (const ParamPreset& preset : presets()) {
+			if (preset.name == name) {
+				return &preset;
+			}
+		}
+		return nullptr;
+	}
+	/*
+	自动选择：能放下 slots 个槽位（打包布局为 h*w*c，逐通道布局为 h*w）且乘法深度不少于 depth 的最小预设，
+	环越小每个操作越快；都放不下时返回能满足 depth 的最大预设，图像再用 enc_image_tiled 分块。
+	尺度低于 2^min_auto_scale_bits 的预设（N4096，尺度 2^20）没有调参结果表明其精度能区分 image_similarity_threshold，
+	不参与自动选择，只能用 findPreset/fromPreset 显式指定（精度可以用 tools/tuner 检查）
+	*/
+	static const int min_auto_scale_bits = 40;
+	static const ParamPreset& selectPreset(size_t slots, size_t depth = 1) {
+		const ParamPreset* largest = nullptr;
+		for (const ParamPreset& preset : presets()) {
+			if (preset.depth() < depth || preset.scale_bits < min_auto_scale_bits) {
+				continue;
+			}
+			if (preset.slots() >= slots) {
+				return preset;
+			}
+			largest = &preset;
+		}
+		return largest ? *largest : presets().back();
+	}
+	static EncryptionParameters presetParameters(const ParamPreset& preset) {
+		EncryptionParameters params(seal::scheme_type::ckks);
+		params.set_poly_modulus_degree(preset.poly_modulus_degree);
+		params.set_coeff_modulus(CoeffModulus::Create(preset.poly_modulus_degree, preset.coeff_modulus));
+		return params;
+	}
+	// 预设的参数描述，格式与 parameterHeader 相同
+	static string presetHeader(const ParamPreset& preset) {
+		ostringstream out;
+		out << preset.poly_modulus_degree << " " << preset.scale_bits << " ";
+		for (size_t i = 0; i < preset.coeff_modulus.size(); i++) {
+			out << (i == 0 ? "" : ",") << preset.coeff_modulus[i];
+		}
+		return out.str();
+	}
+	// 当前参数对应的预设名，不是 presets() 中的参数时为空
+	string presetName() const {
+		string header = parameterHeader();
+		for (const ParamPreset& preset : presets()) {
+			if (presetHeader(preset) == header) {
+				return preset.name;
+			}
+		}
+		return "";
+	}
+	// 参数描述 "<poly_modulus_degree> <log2(scale)> <各素数位数，逗号分隔>"，记录在密文包索引的头部
+	string parameterHeader() const {
+		ostringstream out;
+		out << parms.poly_modulus_degree() << " " << static_cast<int>(round(log2(scale))) << " ";
+		for (size_t i = 0; i < parms.coeff_modulus().size(); i++) {
+			out << (i == 0 ? "" : ",") << parms.coeff_modulus()[i].bit_count();
+		}
+		return out.str();
+	}
+	double getScale() const {
 		return scale;
 	}
-	size_t getSlot() {
+	const SEALContext& getContext() const {
+		return context;
+	}
+	size_t getSlot() const {
 		return slot_count;
 	}
 	void getPublicKey(PublicKey& publicKey) {
 		publicKey = public_key;
 	}
-	void savePublic(string str) {
+	void savePublic(string str, compr_mode_type compr_mode = Serialization::compr_mode_default) {
 		str = str + "\\public";
 		if (!create_directories(str)) {
-			// ʧ
+			// 创建失败
 			cerr << "Failed to create directory: " << str << std::endl;
 		}
 		//else {
-		//	// ļдɹ
+		//	// 文件夹创建成功
 		//	cout << "Directory created successfully: " << str << std::endl;
 		//}
 		ofstream public_key_file(str + "\\public_key.txt", ios::binary);
 		ofstream gal_keys_file(str + "\\gal_keys.txt", ios::binary);
 		ofstream relin_keys_file(str + "\\relin_keys.txt", ios::binary);
 
-		public_key.save(public_key_file);
-		gal_keys.save(gal_keys_file);
-		relin_keys.save(relin_keys_file);
+		public_key.save(public_key_file, compr_mode);
+		galoisKeys().save(gal_keys_file, compr_mode);
+		relinKeys().save(relin_keys_file, compr_mode);
+		saveBatchGaloisKeys(str, compr_mode);
 		cout << "publicKeys are saved in " << str << endl;
 	}
-	void savePrivate(string str) {
+	void savePrivate(string str, compr_mode_type compr_mode = Serialization::compr_mode_default) {
 		str = str + "\\private";
 		if (!create_directories(str)) {
-			// ʧ
+			// 创建失败
 			cerr << "Failed to create directory: " << str << std::endl;
 		}
 		//else {
-		//	// ļдɹ
+		//	// 文件夹创建成功
 		//	cout << "Directory created successfully: " << str << std::endl;
 		//}
 		ofstream gal_keys_file(str + "\\gal_keys.txt", ios::binary);
@@ -296,32 +779,191 @@ public:
 		ofstream secret_key_file(str + "\\secret_key.txt", ios::binary);
 		ofstream relin_keys_file(str + "\\relin_keys.txt", ios::binary);
 
-		gal_keys.save(gal_keys_file);
-		public_key.save(public_key_file);
-		secret_key.save(secret_key_file);
-		relin_keys.save(relin_keys_file);
+		galoisKeys().save(gal_keys_file, compr_mode);
+		public_key.save(public_key_file, compr_mode);
+		secret_key.save(secret_key_file, compr_mode);
+		relinKeys().save(relin_keys_file, compr_mode);
+		saveBatchGaloisKeys(str, compr_mode);
 		cout << "secretKeys are saved in " << str << endl;
 	}
+	// 公钥和私钥立即载入，重线性化密钥和 Galois 密钥在第一次用到时才从 str 目录载入
 	void loadPrivate(const string str) {
-		ifstream gal_keys_file(str + "\\gal_keys.txt", ios::binary);
 		ifstream public_key_file(str + "\\public_key.txt", ios::binary);
 		ifstream secret_key_file(str + "\\secret_key.txt", ios::binary);
-		ifstream relin_keys_file(str + "\\relin_keys.txt", ios::binary);
 
-		gal_keys.load(context, gal_keys_file);
 		public_key.load(context, public_key_file);
 		secret_key.load(context, secret_key_file);
-		relin_keys.load(context, relin_keys_file);
+		{
+			lock_guard<mutex> lock(key_mutex);
+			keyGen.reset();
+			key_dir = str;
+			relin_ready = false;
+			gal_ready = false;
+			batch_ready = false;
+		}
 
-		encryptor = make_unique<Encryptor>(context, public_key);
+		encryptor = make_unique<Encryptor>(context, public_key, secret_key);
 		evaluator = make_unique<Evaluator>(context);
 		decryptor = make_unique<Decryptor>(context, secret_key);
 	}
-	void saveCiphertext(const string str, const Ciphertext& cipher) {
+	/*
+	第一次调用时生成或载入密钥，之后直接返回；多个线程同时第一次调用时只有一个线程执行载入。
+	key_dir 为空时用 keyGen 生成（Galois 密钥只生成 rotation_steps 中的步长），否则从 key_dir 载入；
+	载入的 gal_keys.txt 含有 rotation_steps 以外的步长时只在内存中删除并输出提示，文件保持不变（改写文件见 migrateKeys），
+	缺少 rotation_steps 中的步长时输出警告，这些旋转会退化为多次旋转的 NAF 分解。
+	*/
+	const RelinKeys& relinKeys() const {
+		if (!relin_ready.load(memory_order_acquire)) {
+			lock_guard<mutex> lock(key_mutex);
+			if (!relin_ready.load(memory_order_relaxed)) {
+				if (key_dir.empty()) {
+					keyGen->create_relin_keys(relin_keys);
+				}
+				else {
+					ifstream relin_keys_file(key_dir + "\\relin_keys.txt", ios::binary);
+					relin_keys.load(context, relin_keys_file);
+				}
+				relin_ready.store(true, memory_order_release);
+			}
+		}
+		return relin_keys;
+	}
+	const GaloisKeys& galoisKeys() const {
+		if (!gal_ready.load(memory_order_acquire)) {
+			lock_guard<mutex> lock(key_mutex);
+			if (!gal_ready.load(memory_order_relaxed)) {
+				if (key_dir.empty()) {
+					keyGen->create_galois_keys(rotation_steps, gal_keys);
+				}
+				else {
+					ifstream gal_keys_file(key_dir + "\\gal_keys.txt", ios::binary);
+					gal_keys.load(context, gal_keys_file);
+					size_t trimmed = trimGaloisKeys(gal_keys, rotation_steps);
+					if (trimmed != 0) {
+						cout << "Note: ignored " << trimmed << " Galois keys in " << key_dir << "\\gal_keys.txt outside the rotation steps"
+							<< " (migrateKeys rewrites the file)" << endl;
+					}
+					reportMissingSteps(gal_keys, rotation_steps, key_dir + "\\gal_keys.txt");
+				}
+				gal_ready.store(true, memory_order_release);
+			}
+		}
+		return gal_keys;
+	}
+	/*
+	replicate/extract 用到的 Galois 密钥（batchRotationSteps 与 rotation_steps 的并集），第一次调用时才生成：
+	rotation_steps 已经包含这些步长时直接返回 galoisKeys()；从 key_dir 载入的密钥优先读取 gal_keys_batch.txt，
+	不存在时用私钥生成并保存到该文件。只做 dot/search 的进程不会生成这组密钥
+	*/
+	const GaloisKeys& batchGaloisKeys() const {
+		if (coversSteps(batchRotationSteps(slot_count))) {
+			return galoisKeys();
+		}
+		if (!batch_ready.load(memory_order_acquire)) {
+			lock_guard<mutex> lock(key_mutex);
+			if (!batch_ready.load(memory_order_relaxed)) {
+				string batch_path = key_dir + "\\gal_keys_batch.txt";
+				if (!key_dir.empty() && exists(batch_path)) {
+					ifstream batch_file(batch_path, ios::binary);
+					batch_gal_keys.load(context, batch_file);
+					reportMissingSteps(batch_gal_keys, batchKeySteps(), batch_path);
+				}
+				else {
+					vector<int> steps = batchKeySteps();
+					if (keyGen) {
+						keyGen->create_galois_keys(steps, batch_gal_keys);
+					}
+					else {
+						KeyGenerator generator(context, secret_key);
+						generator.create_galois_keys(steps, batch_gal_keys);
+					}
+					if (!key_dir.empty()) {
+						ofstream batch_file(batch_path, ios::binary);
+						batch_gal_keys.save(batch_file);
+					}
+				}
+				batch_ready.store(true, memory_order_release);
+			}
+		}
+		return batch_gal_keys;
+	}
+	// 按新的旋转步长重新生成 Galois 密钥（需要私钥），之后 savePrivate 保存的也是这组密钥
+	void setRotationSteps(const vector<int>& steps) {
+		lock_guard<mutex> lock(key_mutex);
+		if (!keyGen) {
+			keyGen = make_unique<KeyGenerator>(context, secret_key);
+		}
+		rotation_steps = steps;
+		keyGen->create_galois_keys(rotation_steps, gal_keys);
+		gal_ready = true;
+	}
+	/*
+	显式迁移 savePrivate 保存在 key_dir\\private 下的密钥：旧版本的 gal_keys.txt 含有全部步长，
+	还没有 gal_keys_batch.txt 时先把 replicate/extract 用到的密钥写入该文件，再把 gal_keys.txt 改写为只含 rotation_steps 的密钥，
+	之后的启动只载入需要的密钥。两组都不需要的步长被删除并逐个输出；gal_keys.txt 缺少 rotation_steps 中的步长时不改写。
+	每个文件都先写到 .tmp 再替换，失败时返回 false，原文件保持不变
+	*/
+	bool migrateKeys(const string& key_dir) const {
+		lock_guard<mutex> lock(key_mutex);
+		string gal_path = key_dir + "\\private\\gal_keys.txt";
+		string batch_path = key_dir + "\\private\\gal_keys_batch.txt";
+		ifstream gal_keys_file(gal_path, ios::binary);
+		if (!gal_keys_file.is_open()) {
+			cerr << "Error: can't open " << gal_path << endl;
+			return false;
+		}
+		GaloisKeys keys;
+		keys.load(context, gal_keys_file);
+		gal_keys_file.close();
+		if (reportMissingSteps(keys, rotation_steps, gal_path)) {
+			return true;
+		}
+		vector<int> batch_steps = batchKeySteps();
+		GaloisKeys batch_keys = keys;
+		if (trimGaloisKeys(keys, rotation_steps) == 0) {
+			return true;
+		}
+		// 已有的 gal_keys_batch.txt 保持不变
+		bool batch_saved = exists(batch_path);
+		if (!batch_saved && missingSteps(batch_keys, batch_steps).empty()) {
+			GaloisKeys saved = batch_keys;
+			trimGaloisKeys(saved, batch_steps);
+			if (!replaceKeyFile(batch_path, saved)) {
+				return false;
+			}
+			batch_saved = true;
+		}
+		// 迁移后不再保存在任何文件中的步长
+		auto galois_tool = context.key_context_data()->galois_tool();
+		for (int step = 1; step < static_cast<int>(slot_count); step++) {
+			for (int signed_step : { step, -step }) {
+				bool kept = find(rotation_steps.begin(), rotation_steps.end(), signed_step) != rotation_steps.end()
+					|| (batch_saved && find(batch_steps.begin(), batch_steps.end(), signed_step) != batch_steps.end());
+				if (!kept && batch_keys.has_key(galois_tool->get_elt_from_step(signed_step))) {
+					cout << "Note: removed the Galois key of rotation step " << signed_step << " from " << gal_path << endl;
+				}
+			}
+		}
+		if (!replaceKeyFile(gal_path, keys)) {
+			return false;
+		}
+		cout << "Galois keys in " << gal_path << " are migrated to the rotation steps" << endl;
+		return true;
+	}
+	// rotation_steps 是否包含 steps 中的全部步长
+	bool coversSteps(const vector<int>& steps) const {
+		for (int step : steps) {
+			if (find(rotation_steps.begin(), rotation_steps.end(), step) == rotation_steps.end()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	void saveCiphertext(const string str, const Ciphertext& cipher, compr_mode_type compr_mode = Serialization::compr_mode_default) const {
 		ofstream ciphertext_file(str, ios::binary);
 		if (ciphertext_file.is_open()) {
-			// лļ
-			cipher.save(ciphertext_file);
+			// 将密文序列化到文件
+			cipher.save(ciphertext_file, compr_mode);
 			ciphertext_file.close();
 			//cout << "Ciphertext saved successfully." << endl;
 		}
@@ -330,11 +972,12 @@ public:
 			return;
 		}
 	}
-	void loadCiphertext(const string str, Ciphertext& cipher) {
+	void loadCiphertext(const string str, Ciphertext& cipher) const {
 		ifstream loaded_ciphertext_file(str, ios::binary);
 		if (loaded_ciphertext_file.is_open()) {
-			// ļ
-			cipher.load(context, loaded_ciphertext_file);
+			// 从文件加载密文
+			MetricTimer timer(MetricOp::deserialize);
+			Metrics::instance().add(MetricCounter::bytes_loaded, static_cast<uint64_t>(cipher.load(context, loaded_ciphertext_file)));
 			loaded_ciphertext_file.close();
 			//cout << "Ciphertext loaded successfully." << endl;
 		}
@@ -343,61 +986,224 @@ public:
 			return;
 		}
 	}
-	void encrypt(const vector<double>& input, Ciphertext& result) {
+	// 直接从内存缓冲区（如内存映射的密文包）反序列化，不经过中间的流拷贝
+	void loadCiphertext(const seal_byte* data, size_t size, Ciphertext& cipher) const {
+		MetricTimer timer(MetricOp::deserialize);
+		cipher.load(context, data, size);
+		Metrics::instance().add(MetricCounter::bytes_loaded, size);
+	}
+	void savePlaintext(const string str, const Plaintext& plain, compr_mode_type compr_mode = Serialization::compr_mode_default) const {
+		ofstream plaintext_file(str, ios::binary);
+		if (!plaintext_file.is_open()) {
+			cerr << "Unable to open the file for writing." << endl;
+			return;
+		}
+		plain.save(plaintext_file, compr_mode);
+	}
+	void loadPlaintext(const string str, Plaintext& plain) const {
+		ifstream plaintext_file(str, ios::binary);
+		if (!plaintext_file.is_open()) {
+			cerr << "Unable to open the file for reading." << endl;
+			return;
+		}
+		plain.load(context, plaintext_file);
+	}
+	/*
+	明文库的编码：直接编码成 NTT 形式的 Plaintext，放在一次乘法后仍可 rescale 的最低层级，
+	与查询密文做 multiply_plain 时不需要再做任何转换
+	*/
+	void encodePlain(const vector<double>& input, Plaintext& result) const {
+		MetricTimer timer(MetricOp::encode);
+		encoder.encode(input, lowestParmsId(), scale, result);
+	}
+	void encode(const vector<double>& input, Plaintext& result) const {
+		MetricTimer timer(MetricOp::encode);
+		encoder.encode(input, scale, result);
+	}
+	void decodePlain(const Plaintext& plain, vector<double>& result) const {
+		MetricTimer timer(MetricOp::decode);
+		encoder.decode(plain, result);
+	}
+	void encrypt(const vector<double>& input, Ciphertext& result) const {
 		Plaintext x_plain;
-		encoder.encode(input, scale, x_plain);
+		encode(input, x_plain);
+		MetricTimer timer(MetricOp::encrypt);
 		encryptor->encrypt(x_plain, result);
 	}
-	void decrypt(const Ciphertext& cipher, vector<double>& result) {
-		Plaintext plain;
-		decryptor->decrypt(cipher, plain);
-		encoder.decode(plain, result);
+	/*
+	按 format 加密并直接序列化到 out，返回写入的字节数；seeded 的密文只以序列化形式存在。
+	ciphers 为整幅图像的密文数（分块图像为 块数 * 通道数），lowest_level 时按 imageParmsId(ciphers) 选择层级
+	*/
+	size_t encryptTo(const vector<double>& input, ostream& out, const CipherFormat& format, size_t ciphers = 1) const {
+		parms_id_type parms_id = format.lowest_level ? imageParmsId(ciphers) : context.first_parms_id();
+		Plaintext x_plain;
+		{
+			MetricTimer timer(MetricOp::encode);
+			encoder.encode(input, parms_id == parms_id_zero ? context.first_parms_id() : parms_id, scale, x_plain);
+		}
+		return encryptTo(x_plain, out, format);
 	}
-	void add(Ciphertext& cipher_1, Ciphertext& cipher_2, Ciphertext& result) {
-		parms_id_type id_1 = cipher_1.parms_id();
-		parms_id_type id_2 = cipher_2.parms_id();
-		if (cipher_1.parms_id() != cipher_2.parms_id()) {
-			if (id_1 > id_2) {
-				evaluator->mod_switch_to_inplace(cipher_1, id_2);
+	size_t encryptSelfDotTo(const vector<double>& input, ostream& out, const CipherFormat& format) const {
+		Plaintext x_plain;
+		{
+			MetricTimer timer(MetricOp::encode);
+			encoder.encode(::dot(input, input), format.lowest_level ? context.last_parms_id() : context.first_parms_id(), scale, x_plain);
+		}
+		return encryptTo(x_plain, out, format);
+	}
+	/*
+	ciphers 个密文的图像内积（dotImage）仍能正确解码的最低层级：像素取值在 [0, 1]，各密文乘积累加后每个槽位不超过 ciphers（尺度 scale^2），
+	rescale 后槽位求和不超过 ciphers * slot_count（尺度 scale），两者都要小于当时的模数，并各留出符号位和 1 位余量。
+	只剩 q0 时 N8192 约放得下 2^18 个槽位的和（约 87000 像素的 RGB 图像），更大的分块图像需要高一层；所有层级都放不下时返回 parms_id_zero
+	*/
+	parms_id_type imageParmsId(size_t ciphers) const {
+		ciphers = max<size_t>(ciphers, 1);
+		int scale_bits = static_cast<int>(ceil(log2(scale)));
+		int slot_bits = static_cast<int>(ceil(log2(static_cast<double>(ciphers))));
+		int sum_bits = static_cast<int>(ceil(log2(static_cast<double>(ciphers) * slot_count)));
+		auto context_data = context.last_context_data();
+		while (true) {
+			auto next = context_data->next_context_data();
+			if (next && context_data->total_coeff_modulus_bit_count() >= 2 * scale_bits + slot_bits + 2
+				&& next->total_coeff_modulus_bit_count() >= scale_bits + sum_bits + 2) {
+				return context_data->parms_id();
 			}
-			else {
-				evaluator->mod_switch_to_inplace(cipher_2, id_1);
+			if (context_data->parms_id() == context.first_parms_id()) {
+				return parms_id_zero;
 			}
+			context_data = context_data->prev_context_data();
 		}
-		evaluator->add(cipher_1, cipher_2, result);
 	}
-	void square(const Ciphertext& cipher, Ciphertext& result) {
-		evaluator->square(cipher, result);
-		evaluator->relinearize_inplace(result, relin_keys);
-		evaluator->rescale_to_next_inplace(result);
+	// 一幅 pixels 个像素、channel 个通道的图像按 slot_count 分块后的密文数
+	size_t tileCiphers(size_t pixels, size_t channel) const {
+		return (pixels + slot_count - 1) / slot_count * channel;
 	}
-	void mul_vector(const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result) {
-		evaluator->multiply(cipher_1, cipher_2, result);
-		evaluator->relinearize_inplace(result, relin_keys);
-		evaluator->rescale_to_next_inplace(result);
+	// 图像的槽位求和能否在当前参数下正确解码（imageParmsId），不能时输出错误
+	bool fitsImage(const Mat& image) const {
+		size_t ciphers = tileCiphers(static_cast<size_t>(image.rows) * image.cols, image.channels());
+		if (imageParmsId(ciphers) == parms_id_zero) {
+			cerr << "Error: image of " << image.rows << "x" << image.cols << "x" << image.channels()
+				<< " is too large for the encryption parameters (" << parameterHeader() << ")" << endl;
+			return false;
+		}
+		return true;
 	}
-	void dot(Ciphertext& cipher_1, Ciphertext& cipher_2, Ciphertext& result) {
-		parms_id_type id_1 = cipher_1.parms_id();
-		parms_id_type id_2 = cipher_2.parms_id();
-		if (cipher_1.parms_id() != cipher_2.parms_id()) {
-			if (id_1 > id_2) {
-				evaluator->mod_switch_to_inplace(cipher_1, id_2);
-			}
-			else {
-				evaluator->mod_switch_to_inplace(cipher_2, id_1);
-			}
-
+	// 之后还能做 depth 次乘法和 rescale 的最低层级
+	parms_id_type lowestParmsId(size_t depth = 1) const {
+		auto context_data = context.last_context_data();
+		while (context_data->chain_index() < depth && context_data->prev_context_data()) {
+			context_data = context_data->prev_context_data();
 		}
-		mul_vector(cipher_1, cipher_2, result);
-		for (int i = 1; i < slot_count; i <<= 1) { // һλ൱ڳ2
-			Ciphertext rotated;
-			evaluator->rotate_vector(result, i, gal_keys, rotated);	// resultתiתƫrotated洢
-			evaluator->add_inplace(result, rotated);
+		return context_data->parms_id();
+	}
+	// 把密文切换到 parms_id 所在的层级，只向下切换，已经不高于该层级时直接复制
+	void modSwitchTo(const Ciphertext& cipher, parms_id_type parms_id, Ciphertext& result) const {
+		size_t level = context.get_context_data(cipher.parms_id())->chain_index();
+		size_t target = context.get_context_data(parms_id)->chain_index();
+		if (level > target) {
+			MetricTimer timer(MetricOp::mod_switch);
+			evaluator->mod_switch_to(cipher, parms_id, result);
+		}
+		else {
+			result = cipher;
+		}
+	}
+	size_t encryptTo(const Plaintext& plain, ostream& out, const CipherFormat& format) const {
+		MetricTimer timer(MetricOp::encrypt);
+		if (format.seeded) {
+			return static_cast<size_t>(encryptor->encrypt_symmetric(plain).save(out, format.compr_mode));
+		}
+		Ciphertext cipher;
+		encryptor->encrypt(plain, cipher);
+		return static_cast<size_t>(cipher.save(out, format.compr_mode));
+	}
+	void decrypt(const Ciphertext& cipher, vector<double>& result) const {
+		Scratch& scratch = threadScratch();
+		{
+			MetricTimer timer(MetricOp::decrypt);
+			decryptor->decrypt(cipher, scratch.plain);
+		}
+		MetricTimer timer(MetricOp::decode);
+		encoder.decode(scratch.plain, result, scratch.pool);
+	}
+	void add(const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result) const {
+		const Ciphertext* lhs = &cipher_1;
+		const Ciphertext* rhs = &cipher_2;
+		Scratch& scratch = threadScratch();
+		align(*evaluator, lhs, rhs, scratch);
+		evaluator->add(*lhs, *rhs, result);
+	}
+	void square(const Ciphertext& cipher, Ciphertext& result) const {
+		{
+			MetricTimer timer(MetricOp::multiply);
+			evaluator->square(cipher, result);
+		}
+		relinearize(*evaluator, result, threadScratch());
+		rescale(*evaluator, result, threadScratch());
+	}
+	void mul_vector(const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result) const {
+		mul_vector(*evaluator, cipher_1, cipher_2, result, threadScratch());
+	}
+	/*
+	span 为参与求和的槽位数（2 的幂），0 表示全部槽位；乘积只在两个向量都非零的槽位上非零，
+	因此 span 取不小于查询图像 h*w 的 2 的幂即可得到完整的内积
+	*/
+	void dot(const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result, size_t span = 0) const {
+		dot(*evaluator, cipher_1, cipher_2, result, span, threadScratch());
+	}
+	// 槽位求和内核：对每个长度为 span 的块求和，结果位于每块的第一个槽位
+	void sumSlots(Ciphertext& cipher, size_t span) const {
+		sumSlots(*evaluator, cipher, span, threadScratch());
+	}
+	// replicate 用到的右旋步长 -span, -2*span, ...；extract 的旋转由正负 2 的幂组合而成，span 取 1 即可覆盖
+	static vector<int> batchRotationSteps(size_t slot_count, size_t span = 1) {
+		vector<int> steps = rotationSteps(slot_count);
+		for (size_t i = span; i < slot_count; i <<= 1) {
+			steps.push_back(-static_cast<int>(i));
 		}
+		return steps;
 	}
-	void enc_image(const string str, vector<Ciphertext>& result) {
+	const vector<int>& getRotationSteps() const {
+		return rotation_steps;
+	}
+	// 对 span 个槽位求和用到的旋转步长 1, 2, 4, ..., span/2
+	static vector<int> rotationSteps(size_t span) {
+		vector<int> steps;
+		for (size_t i = 1; i < span; i <<= 1) {
+			steps.push_back(static_cast<int>(i));
+		}
+		return steps;
+	}
+	/*
+	图像级内积：各通道相乘后先在密文下累加，再做一次重线性化、rescale 和旋转求和，
+	每个候选只需解密一次，开销与通道数基本无关
+	*/
+	void dotImage(const vector<Ciphertext>& ciphers_1, const vector<Ciphertext>& ciphers_2, Ciphertext& result, size_t span = 0) const {
+		dotImage(*evaluator, ciphers_1, ciphers_2, result, span, threadScratch());
+	}
+	// 图像级余弦相似度，norm1、norm2 为各通道平方范数之和
+	double imageSimilarity(const vector<Ciphertext>& ciphers1, const vector<Ciphertext>& ciphers2, double norm1, double norm2, size_t span = 0) const {
+		Scratch& scratch = threadScratch();
+		dotImage(*evaluator, ciphers1, ciphers2, scratch.result, span, scratch);
+		decrypt(scratch.result, scratch.values);
+		return scratch.values[0] / sqrt(norm1 * norm2);
+	}
+	/*
+	密文查询与明文库图像的内积：各通道 multiply_plain 后累加，密文大小保持为 2，
+	不需要重线性化，只做一次 rescale 和旋转求和
+	*/
+	void dotImage(const vector<Ciphertext>& ciphers, const vector<Plaintext>& plains, Ciphertext& result, size_t span = 0) const {
+		dotImage(*evaluator, ciphers, plains, result, span, threadScratch());
+	}
+	double imageSimilarity(const vector<Ciphertext>& ciphers, const vector<Plaintext>& plains, double norm1, double norm2, size_t span = 0) const {
+		Scratch& scratch = threadScratch();
+		dotImage(*evaluator, ciphers, plains, scratch.result, span, scratch);
+		decrypt(scratch.result, scratch.values);
+		return scratch.values[0] / sqrt(norm1 * norm2);
+	}
+	void enc_image(const string str, vector<Ciphertext>& result) const {
 		vector<vector<double>> imageMatrix;
-		getImageVector(str, imageMatrix);
+		getImageVector(str, imageMatrix, slot_count);
 		if (imageMatrix.empty()) {
 			cerr << "Error: can't read image" << endl;
 			result = vector<Ciphertext>();
@@ -409,14 +1215,129 @@ public:
 			result.push_back(temp);
 		}
 	}
-	void dec_image(const vector<Ciphertext>& ciphers, vector<vector<double>>& result) {
+	// 同时输出每个通道的加密平方范数 <v, v>，入库时与通道密文一同保存
+	void enc_image(const string str, vector<Ciphertext>& result, vector<Ciphertext>& norms) const {
+		vector<vector<double>> imageMatrix;
+		getImageVector(str, imageMatrix, slot_count);
+		if (imageMatrix.empty()) {
+			cerr << "Error: can't read image" << endl;
+			result = vector<Ciphertext>();
+			norms = vector<Ciphertext>();
+			return;
+		}
+		for (vector<double>& it : imageMatrix) {
+			Ciphertext temp, norm;
+			encrypt(it, temp);
+			encryptSelfDot(it, norm);
+			result.push_back(temp);
+			norms.push_back(norm);
+		}
+	}
+	/*
+	h*w*c <= slot_count 时把所有通道打包进一个密文，第 c 个通道位于槽位 [c*stride, c*stride + h*w)，
+	stride = slot_count / c；norm 为整幅图像的平方范数。图像放不下时返回 false。
+	*/
+	bool enc_image_packed(const string str, Ciphertext& result, Ciphertext& norm) const {
+		if (!isImage(str)) {
+			return false;
+		}
+		Mat image = imread(str);
+		size_t channel = image.channels();
+		if (image.empty() || channel > 4 || channel * image.rows * image.cols > slot_count) {
+			return false;
+		}
+		// 各通道直接从 Mat 拆分到槽位缓冲区中各自的位置，缓冲区按线程复用
+		size_t stride = slot_count / channel;
+		thread_local vector<double> slots;
+		slots.assign(slot_count, 0.0);
+		double* dst[4];
+		for (size_t c = 0; c < channel; c++) {
+			dst[c] = slots.data() + c * stride;
+		}
+		if (!deinterleaveImage(image, dst)) {
+			return false;
+		}
+		encrypt(slots, result);
+		encryptSelfDot(slots, norm);
+		return true;
+	}
+	void dec_image_packed(const Ciphertext& cipher, size_t channel, vector<vector<double>>& result) const {
+		vector<double> slots;
+		decrypt(cipher, slots);
+		size_t stride = slot_count / channel;
+		for (size_t c = 0; c < channel; c++) {
+			result.push_back(vector<double>(slots.begin() + c * stride, slots.begin() + (c + 1) * stride));
+		}
+	}
+	/*
+	分块加密任意大小的图像：按行优先顺序每 slot_count 个像素为一块，第 t 块第 c 个通道的密文为 result[t * 通道数 + c]，
+	逐块读取和加密，内存中只保留一块的像素。只有一块时布局与 enc_image 相同，dotImage/imageSimilarity 直接对所有块的乘积
+	在密文下累加，一次解密得到整幅图像的内积；不同尺寸的图像块数不同，不会被比较。
+	图像过大、所有层级都放不下槽位求和时（fitsImage）返回 false
+	*/
+	bool enc_image_tiled(const string str, vector<Ciphertext>& result, vector<Ciphertext>& norms) const {
+		result.clear();
+		norms.clear();
+		Mat image = isImage(str) ? imread(str) : Mat();
+		if (image.empty()) {
+			cerr << "Error: can't read image " << str << endl;
+			return false;
+		}
+		return enc_image_tiled(image, result, norms);
+	}
+	bool enc_image_tiled(const string str, vector<Ciphertext>& result) const {
+		result.clear();
+		Mat image = isImage(str) ? imread(str) : Mat();
+		if (image.empty()) {
+			cerr << "Error: can't read image " << str << endl;
+			return false;
+		}
+		return enc_image_tiled(image, result);
+	}
+	bool enc_image_tiled(const Mat& image, vector<Ciphertext>& result) const {
+		result.clear();
+		if (!fitsImage(image)) {
+			return false;
+		}
+		return forEachImageTile(image, slot_count, [&](size_t tile, size_t channel, const vector<double>& pixels) {
+			Ciphertext temp;
+			encrypt(pixels, temp);
+			result.push_back(temp);
+		});
+	}
+	bool enc_image_tiled(const Mat& image, vector<Ciphertext>& result, vector<Ciphertext>& norms) const {
+		result.clear();
+		norms.clear();
+		if (!fitsImage(image)) {
+			return false;
+		}
+		return forEachImageTile(image, slot_count, [&](size_t tile, size_t channel, const vector<double>& pixels) {
+			Ciphertext temp, norm;
+			encrypt(pixels, temp);
+			encryptSelfDot(pixels, norm);
+			result.push_back(temp);
+			norms.push_back(norm);
+		});
+	}
+	// enc_image_tiled 的逆过程，pixels 为 h*w，结果的形状为 (channel, h*w)
+	void dec_image_tiled(const vector<Ciphertext>& ciphers, size_t channel, size_t pixels, vector<vector<double>>& result) const {
+		result = vector<vector<double>>(channel);
+		for (size_t i = 0; i < ciphers.size(); i++) {
+			vector<double> temp;
+			decrypt(ciphers[i], temp);
+			vector<double>& out = result[i % channel];
+			size_t count = min(slot_count, pixels - out.size());
+			out.insert(out.end(), temp.begin(), temp.begin() + count);
+		}
+	}
+	void dec_image(const vector<Ciphertext>& ciphers, vector<vector<double>>& result) const {
 		for (auto& it : ciphers) {
 			vector<double> temp;
 			decrypt(it, temp);
 			result.push_back(temp);
 		}
 	}
-	double cosineSimilarity(Ciphertext& cipher1, Ciphertext& cipher2) {
+	double cosineSimilarity(const Ciphertext& cipher1, const Ciphertext& cipher2) const {
 		Ciphertext result1, result2, result3;
 		dot(cipher1, cipher2, result1);
 		dot(cipher1, cipher1, result2);
@@ -428,25 +1349,286 @@ public:
 		double ret = vec1[0] / sqrt((vec2[0] * vec3[0]));
 		return ret;
 	}
+	// norm1、norm2 为预先计算好的平方范数，每个候选只需一次 dot 和一次解密
+	double cosineSimilarity(const Ciphertext& cipher1, const Ciphertext& cipher2, double norm1, double norm2) const {
+		Scratch& scratch = threadScratch();
+		dot(*evaluator, cipher1, cipher2, scratch.result, 0, scratch);
+		decrypt(scratch.result, scratch.values);
+		return scratch.values[0] / sqrt(norm1 * norm2);
+	}
+	// 密文的平方范数 <c, c>
+	double selfDot(const Ciphertext& cipher) const {
+		Scratch& scratch = threadScratch();
+		dot(*evaluator, cipher, cipher, scratch.result, 0, scratch);
+		decrypt(scratch.result, scratch.values);
+		return scratch.values[0];
+	}
+	// 在明文下计算 <v, v> 并加密，避免入库时做同态内积
+	void encryptSelfDot(const vector<double>& input, Ciphertext& result) const {
+		Plaintext x_plain;
+		{
+			MetricTimer timer(MetricOp::encode);
+			encoder.encode(::dot(input, input), scale, x_plain);
+		}
+		MetricTimer timer(MetricOp::encrypt);
+		encryptor->encrypt(x_plain, result);
+	}
+	double decryptSelfDot(const Ciphertext& cipher) const {
+		vector<double> vec;
+		decrypt(cipher, vec);
+		return vec[0];
+	}
+	/*
+	把槽位 [0, span) 中的向量复制到每个长度为 span 的块中，要求 span 为 2 的幂且 span 之后的槽位为 0，
+	用于把查询向量与按块打包的多个库内向量对齐。
+	*/
+	void replicate(const Ciphertext& cipher, size_t span, Ciphertext& result) const {
+		result = cipher;
+		for (size_t i = span; i < slot_count; i <<= 1) {
+			Ciphertext rotated;
+			{
+				MetricTimer timer(MetricOp::rotate);
+				evaluator->rotate_vector(result, -static_cast<int>(i), batchGaloisKeys(), rotated);
+			}
+			evaluator->add_inplace(result, rotated);
+		}
+	}
+	/*
+	批量内积：batch[c] 的第 k 个块 [k*span, (k+1)*span) 为第 k 个候选的第 c 个通道，replicated_query 为 replicate 的结果。
+	块外的槽位为 0，各通道乘积累加后只在块内做旋转求和，一次解密得到全部 count 个候选的图像级内积。
+	*/
+	void dotBatch(const vector<Ciphertext>& replicated_query, const vector<Ciphertext>& batch, size_t span, size_t count, vector<double>& result) const {
+		Ciphertext product;
+		dotImage(*evaluator, replicated_query, batch, product, span, threadScratch());
+		vector<double> vec;
+		decrypt(product, vec);
+		result.resize(count);
+		for (size_t k = 0; k < count; k++) {
+			result[k] = vec[k * span];
+		}
+	}
+	// 用掩码取出 batch 中第 k 个块，并旋转到槽位 0 开始的位置
+	void extract(const Ciphertext& batch, size_t span, size_t k, Ciphertext& result) const {
+		vector<double> mask(slot_count, 0.0);
+		fill(mask.begin() + k * span, mask.begin() + (k + 1) * span, 1.0);
+		Plaintext mask_plain;
+		{
+			MetricTimer timer(MetricOp::encode);
+			encoder.encode(mask, batch.parms_id(), scale, mask_plain);
+		}
+		{
+			MetricTimer timer(MetricOp::multiply_plain);
+			evaluator->multiply_plain(batch, mask_plain, result);
+		}
+		rescale(*evaluator, result, threadScratch());
+		if (k != 0) {
+			MetricTimer timer(MetricOp::rotate);
+			evaluator->rotate_vector_inplace(result, static_cast<int>(k * span), batchGaloisKeys());
+		}
+	}
 private:
+	/*
+	层级不一致时，把层级较高的一方 mod switch 到较低层级，结果写入临时密文 aligned，
+	并让对应的指针指向 aligned；调用方的密文不会被修改。
+	*/
+	void align(const Evaluator& eval, const Ciphertext*& cipher_1, const Ciphertext*& cipher_2, Scratch& scratch) const {
+		if (cipher_1->parms_id() == cipher_2->parms_id()) {
+			return;
+		}
+		size_t level_1 = context.get_context_data(cipher_1->parms_id())->chain_index();
+		size_t level_2 = context.get_context_data(cipher_2->parms_id())->chain_index();
+		MetricTimer timer(MetricOp::mod_switch);
+		if (level_1 > level_2) {
+			eval.mod_switch_to(*cipher_1, cipher_2->parms_id(), scratch.aligned, scratch.pool);
+			cipher_1 = &scratch.aligned;
+		}
+		else {
+			eval.mod_switch_to(*cipher_2, cipher_1->parms_id(), scratch.aligned, scratch.pool);
+			cipher_2 = &scratch.aligned;
+		}
+	}
+	// replicate/extract 用到的全部步长：batchRotationSteps 与 rotation_steps 的并集
+	vector<int> batchKeySteps() const {
+		vector<int> steps = batchRotationSteps(slot_count);
+		for (int step : rotation_steps) {
+			if (find(steps.begin(), steps.end(), step) == steps.end()) {
+				steps.push_back(step);
+			}
+		}
+		return steps;
+	}
+	// steps 中 keys 没有密钥的步长
+	vector<int> missingSteps(const GaloisKeys& keys, const vector<int>& steps) const {
+		auto galois_tool = context.key_context_data()->galois_tool();
+		vector<int> missing;
+		for (int step : steps) {
+			if (!keys.has_key(galois_tool->get_elt_from_step(step))) {
+				missing.push_back(step);
+			}
+		}
+		return missing;
+	}
+	// 从 path 载入的 keys 缺少 steps 中的步长时输出警告，有缺少时返回 true
+	bool reportMissingSteps(const GaloisKeys& keys, const vector<int>& steps, const string& path) const {
+		vector<int> missing = missingSteps(keys, steps);
+		if (missing.empty()) {
+			return false;
+		}
+		cerr << "Warning: " << path << " has no Galois keys for rotation steps";
+		for (int step : missing) {
+			cerr << " " << step;
+		}
+		cerr << ", these rotations fall back to the slower NAF decomposition" << endl;
+		return true;
+	}
+	// 先写到 path.tmp 再替换 path，写入中途失败时删除临时文件，原文件保持不变
+	bool replaceKeyFile(const string& path, const GaloisKeys& keys) const {
+		ofstream file(path + ".tmp", ios::binary | ios::trunc);
+		keys.save(file);
+		file.close();
+		error_code ec;
+		if (file) {
+			rename(path + ".tmp", path, ec);
+		}
+		if (!file || ec) {
+			cerr << "Error: unable to write " << path << endl;
+			remove(path + ".tmp", ec);
+			return false;
+		}
+		return true;
+	}
+	// 删除 keys 中不属于 steps 的 Galois 密钥，返回删除的密钥数
+	size_t trimGaloisKeys(GaloisKeys& keys, const vector<int>& steps) const {
+		auto galois_tool = context.key_context_data()->galois_tool();
+		vector<char> wanted(keys.data().size(), 0);
+		for (int step : steps) {
+			size_t index = GaloisKeys::get_index(galois_tool->get_elt_from_step(step));
+			if (index < wanted.size()) {
+				wanted[index] = 1;
+			}
+		}
+		size_t trimmed = 0;
+		for (size_t i = 0; i < keys.data().size(); i++) {
+			if (!wanted[i] && !keys.data()[i].empty()) {
+				keys.data()[i].clear();
+				trimmed++;
+			}
+		}
+		return trimmed;
+	}
+	// 已经生成过 replicate/extract 的密钥时，与其它密钥一起保存到 gal_keys_batch.txt
+	void saveBatchGaloisKeys(const string& str, compr_mode_type compr_mode) const {
+		if (batch_ready.load(memory_order_acquire)) {
+			ofstream batch_file(str + "\\gal_keys_batch.txt", ios::binary);
+			batch_gal_keys.save(batch_file, compr_mode);
+		}
+	}
+	// 未指定 Scratch 的调用使用当前线程的临时对象，内存来自 SEAL 的线程局部内存池
+	static Scratch& threadScratch() {
+		thread_local Scratch scratch(MemoryPoolHandle::ThreadLocal());
+		return scratch;
+	}
+	// 以下实现使用指定的 evaluator 和临时对象，供 CKKS 自身以及各线程的 Worker 共用
+	void relinearize(const Evaluator& eval, Ciphertext& cipher, Scratch& scratch) const {
+		MetricTimer timer(MetricOp::relinearize);
+		eval.relinearize_inplace(cipher, relinKeys(), scratch.pool);
+	}
+	void rescale(const Evaluator& eval, Ciphertext& cipher, Scratch& scratch) const {
+		MetricTimer timer(MetricOp::rescale);
+		eval.rescale_to_next_inplace(cipher, scratch.pool);
+	}
+	void rotate(const Evaluator& eval, const Ciphertext& cipher, int step, Scratch& scratch) const {
+		MetricTimer timer(MetricOp::rotate);
+		eval.rotate_vector(cipher, step, galoisKeys(), scratch.rotated, scratch.pool);
+	}
+	void mul_vector(const Evaluator& eval, const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result, Scratch& scratch) const {
+		const Ciphertext* lhs = &cipher_1;
+		const Ciphertext* rhs = &cipher_2;
+		align(eval, lhs, rhs, scratch);
+		{
+			MetricTimer timer(MetricOp::multiply);
+			eval.multiply(*lhs, *rhs, result, scratch.pool);
+		}
+		relinearize(eval, result, scratch);
+		rescale(eval, result, scratch);
+	}
+	void dot(const Evaluator& eval, const Ciphertext& cipher_1, const Ciphertext& cipher_2, Ciphertext& result, size_t span, Scratch& scratch) const {
+		mul_vector(eval, cipher_1, cipher_2, result, scratch);
+		sumSlots(eval, result, span == 0 ? slot_count : min(span, slot_count), scratch);
+	}
+	void dotImage(const Evaluator& eval, const vector<Ciphertext>& ciphers_1, const vector<Ciphertext>& ciphers_2, Ciphertext& result, size_t span, Scratch& scratch) const {
+		for (size_t c = 0; c < ciphers_1.size() && c < ciphers_2.size(); c++) {
+			const Ciphertext* lhs = &ciphers_1[c];
+			const Ciphertext* rhs = &ciphers_2[c];
+			align(eval, lhs, rhs, scratch);
+			MetricTimer timer(MetricOp::multiply);
+			if (c == 0) {
+				eval.multiply(*lhs, *rhs, result, scratch.pool);
+			}
+			else {
+				eval.multiply(*lhs, *rhs, scratch.product, scratch.pool);
+				eval.add_inplace(result, scratch.product);
+			}
+		}
+		relinearize(eval, result, scratch);
+		rescale(eval, result, scratch);
+		// 分块图像的 pixels 可能超过 slot_count，此时对全部槽位求和
+		sumSlots(eval, result, span == 0 ? slot_count : min(span, slot_count), scratch);
+	}
+	void dotImage(const Evaluator& eval, const vector<Ciphertext>& ciphers, const vector<Plaintext>& plains, Ciphertext& result, size_t span, Scratch& scratch) const {
+		for (size_t c = 0; c < ciphers.size() && c < plains.size(); c++) {
+			// 明文无法切换层级，只能把密文切换到明文所在的层级
+			const Ciphertext* lhs = &ciphers[c];
+			if (lhs->parms_id() != plains[c].parms_id()) {
+				MetricTimer timer(MetricOp::mod_switch);
+				eval.mod_switch_to(*lhs, plains[c].parms_id(), scratch.aligned, scratch.pool);
+				lhs = &scratch.aligned;
+			}
+			MetricTimer timer(MetricOp::multiply_plain);
+			if (c == 0) {
+				eval.multiply_plain(*lhs, plains[c], result, scratch.pool);
+			}
+			else {
+				eval.multiply_plain(*lhs, plains[c], scratch.product, scratch.pool);
+				eval.add_inplace(result, scratch.product);
+			}
+		}
+		rescale(eval, result, scratch);
+		sumSlots(eval, result, span == 0 ? slot_count : min(span, slot_count), scratch);
+	}
+	/*
+	对每个长度为 span（2 的幂）的块求和，结果位于每块的第一个槽位：依次旋转 1, 2, 4, ..., span/2 并累加，共 log2(span) 次旋转。
+	SEAL 没有公开的 hoisting 接口（各旋转共享一次密钥分解），baby-step/giant-step 的旋转次数多于 log2(span)，不会更快
+	*/
+	void sumSlots(const Evaluator& eval, Ciphertext& cipher, size_t span, Scratch& scratch) const {
+		for (size_t i = 1; i < span; i <<= 1) { // 左移一位，相当于乘以2
+			rotate(eval, cipher, static_cast<int>(i), scratch);	// 对cipher做旋转操作，i是旋转偏移量，scratch.rotated存储结果
+			eval.add_inplace(cipher, scratch.rotated);
+		}
+	}
+
 	static EncryptionParameters defaultEncryptionParameters() {
-		EncryptionParameters params(seal::scheme_type::ckks);
-		size_t poly_modulus_degree = 8192;
-		params.set_poly_modulus_degree(poly_modulus_degree);
-		params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, { 60, 40, 40, 60 }));
-		return params;
+		return presetParameters(*findPreset("N8192"));
 	}
 
 	EncryptionParameters parms;
 	double scale;
 	SEALContext context;
-	KeyGenerator keyGen;
+	unique_ptr<KeyGenerator> keyGen;
 	CKKSEncoder encoder;
 
 	SecretKey secret_key;
 	PublicKey public_key;
-	RelinKeys relin_keys;
-	GaloisKeys gal_keys;
+	mutable RelinKeys relin_keys;
+	mutable GaloisKeys gal_keys;
+	mutable GaloisKeys batch_gal_keys;
+	vector<int> rotation_steps;
+	// 延迟生成/载入的密钥
+	string key_dir;
+	mutable mutex key_mutex;
+	mutable atomic<bool> relin_ready{ false };
+	mutable atomic<bool> gal_ready{ false };
+	mutable atomic<bool> batch_ready{ false };
 
 	unique_ptr<Encryptor> encryptor;
 	unique_ptr<Evaluator> evaluator;
@@ -455,5 +1637,344 @@ private:
 	size_t slot_count;
 };
 
-void search(CKKS& cryptor, vector<Ciphertext>& ciphers, const string& image_dir, string& str, vector<Ciphertext>& result, double& count_time);
-void evaluate(CKKS& cryptor, Ciphertext& cipher, double& add_time, double& mul_time, double& dot_time);
\ No newline at end of file
+/*
+只读的内存映射文件，Windows 下使用 CreateFileMapping，其它平台使用 mmap
+*/
+class MappedFile {
+public:
+	explicit MappedFile(const string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	bool is_open() const {
+		return data_ptr != nullptr;
+	}
+	const seal_byte* data() const {
+		return data_ptr;
+	}
+	size_t size() const {
+		return data_size;
+	}
+private:
+	const seal_byte* data_ptr = nullptr;
+	size_t data_size = 0;
+	void* file_handle = nullptr;
+	void* map_handle = nullptr;
+	int fd = -1;
+};
+
+// 密文包索引中的一行：各通道密文和范数密文在包中的 (偏移, 大小)
+struct PackIndexEntry {
+	string name;
+	vector<pair<size_t, size_t>> cipher_ranges;
+	vector<pair<size_t, size_t>> norm_ranges;
+};
+bool parsePackIndexLine(const string& line, PackIndexEntry& entry);
+/*
+密文包的代数：CipherPackWriter 每次写包时随机生成，写在数据文件开头（pack_magic 之后的 8 字节）和索引头部 "# generation <十六进制>"。
+密文包和索引是两次 rename 分别替换的，中途崩溃会留下新包配旧索引，打开时两者的代数不一致即拒绝使用。
+generation 为索引中记录的代数，没有记录代数的旧密文包返回 true
+*/
+const size_t pack_header_size = 16;
+bool packGenerationMatches(const MappedFile& pack, const string& generation);
+// 入库方式的描述，如 "seeded/zstd/lowest"，写入索引头部的 "# format ..."
+string formatHeader(const CipherFormat& format);
+
+/*
+单文件密文包：<pack> 中顺序存放所有图像各通道的密文及其平方范数密文，<pack>.idx 为偏移索引，
+每行格式为 "通道数 (密文偏移 密文大小 范数偏移 范数大小)*通道数 名称"，范数大小为 0 表示未保存范数；
+以 # 开头的行为头部，"# generation ..." 为与数据文件开头一致的代数（packGenerationMatches），"# format ..." 记录入库方式（formatHeader），
+"# params ..." 记录加密参数，
+"# preset ..." 记录加密参数对应的预设名（CKKS::presetName，不是预设参数时没有这一行）。
+*/
+class CipherPackWriter {
+public:
+	// header 非空时作为索引头部的 "# params <header>" 写入，一般为 CKKS::parameterHeader()；preset 非空时写入 "# preset <preset>"
+	explicit CipherPackWriter(const string& _pack_path, const CipherFormat& _format = CipherFormat(), const string& header = "", const string& preset = "");
+	~CipherPackWriter() {
+		close();
+	}
+	void add(const string& name, const vector<Ciphertext>& ciphers, const vector<Ciphertext>& norms);
+	// 直接把明文图像按 format 加密写入包中，seeded 时不经过完整大小的 Ciphertext
+	void addImage(const CKKS& cryptor, const string& name, const vector<vector<double>>& image);
+	// 把已有的 <image>/<channel>.dat 目录树的文件内容原样追加到包中，不需要反序列化
+	void addDirectory(const string& dir);
+	// 追加已经序列化好的各通道密文和范数密文（如并行加密的结果，或从旧密文包中原样复制的字节）
+	void addSerialized(const string& name, const vector<string>& ciphers, const vector<string>& norms);
+	/*
+	逐个密文流式写入一幅图像：beginImage 写入索引行开头的密文数 count，之后按顺序调用 count 次 appendSerialized，
+	最后 endImage 写入名称；大图像不需要把全部密文留在内存中
+	*/
+	void beginImage(size_t count);
+	void appendSerialized(const string& cipher, const string& norm);
+	void endImage(const string& name);
+	void close();
+private:
+	size_t append(const Ciphertext& cipher);
+	size_t appendFile(const string& path);
+
+	string pack_path;
+	CipherFormat format;
+	ofstream data;
+	ofstream index;
+	size_t offset = 0;
+};
+
+void packCiphers(const string& cipher_dir, const string& pack_path);
+
+/*
+增量入库：<pack>.manifest 每行为 "内容哈希 名称 图像路径"，哈希为图像文件内容的 64 位 FNV-1a。
+只有新增或内容变化的图像重新加密，未变化的图像从旧密文包中原样复制，图像列表中已不存在的条目被删除；
+加密的任务为 (图像, 块, 通道)，分给 num_threads 个线程，每批 num_threads * 4 个任务按顺序流式写入密文包，内存中只保留一批密文；
+读取失败或所有层级都放不下槽位求和的图像（CKKS::fitsImage）计入 failed，保留旧的条目和清单中旧的哈希，下次入库时重试；
+入库方式（CipherFormat）与旧索引记录的不同时，全部图像按新的方式重新加密；
+新的密文包、索引和清单先写到 .tmp 文件再 rename 覆盖，中途失败时删除 .tmp 文件，旧的密文包保持不变；
+替换到一半时崩溃，密文包与索引的代数不一致，CipherStore 拒绝载入，下次入库时全部重新加密。
+各条目的名称为 name_dir\<图像文件名（含扩展名，a.jpg 与 a.png 不会冲突）>
+*/
+struct IngestStats {
+	size_t added = 0;
+	size_t updated = 0;
+	size_t unchanged = 0;
+	size_t removed = 0;
+	size_t failed = 0;
+	double hash_time = 0;
+	double encrypt_time = 0;
+	double write_time = 0;
+};
+uint64_t fileHash(const string& path);
+/*
+按入库时的存储布局选择参数预设：每个通道、每个块各为一个密文，所以按 h*w 而不是 h*w*c 选择；
+selectPresetForImages 按其中最大的图像选择，整个库使用同一组参数
+*/
+const ParamPreset& selectPresetForImage(const string& str, size_t depth = 1);
+const ParamPreset& selectPresetForImages(const vector<string>& image_paths, size_t depth = 1);
+bool ingestImages(const CKKS& cryptor, const vector<string>& image_paths, const string& pack_path, const string& name_dir, const CipherFormat& format, IngestStats& stats, size_t num_threads = 0);
+
+/*
+常驻内存的密文图像库：一次性载入 resources/ciphers/<image>/<channel>.dat 目录树，
+查询时直接使用内存中的 Ciphertext，避免每次 search 都重新读盘和反序列化。
+memory_budget 为密文占用内存的上限（字节），0 表示不限制；超出上限时按 LRU 淘汰，
+被淘汰的条目在下次访问时重新从磁盘载入。
+store_path 也可以是 CipherPackWriter 生成的密文包，此时整个包被内存映射，
+密文直接从映射区反序列化，淘汰后重新载入也不需要再读文件。
+*/
+class CipherStore {
+public:
+	CipherStore(const CKKS& _cryptor, const string& _store_path, size_t _memory_budget = 0);
+	// 重新扫描目录（或重新映射密文包）并载入密文（在预算允许的范围内）
+	void reload();
+	size_t size() const {
+		return entries.size();
+	}
+	const string& path(size_t index) const {
+		return entries[index].path;
+	}
+	// 取得第 index 个图像的所有通道密文，未驻留时从磁盘载入
+	shared_ptr<const vector<Ciphertext>> get(size_t index);
+	// 第 index 个图像各通道的平方范数，载入时计算一次后常驻（淘汰密文时保留）
+	vector<double> getNorms(size_t index);
+	// 写入调用方复用的 result，不分配新的内存
+	void getNorms(size_t index, vector<double>& result);
+	size_t getMemoryUsage();
+	size_t getMemoryBudget();
+	void setMemoryBudget(size_t _memory_budget);
+	size_t getLoadCount();
+	// 密文包索引头部记录的加密参数，目录形式的密文库或旧的密文包为空
+	const string& getParameterHeader() const {
+		return parameter_header;
+	}
+	// 密文包索引头部记录的预设名，没有记录时为空
+	const string& getPresetName() const {
+		return preset_name;
+	}
+private:
+	struct Entry {
+		string path;
+		shared_ptr<const vector<Ciphertext>> ciphers;
+		vector<double> norms;
+		size_t bytes = 0;
+		list<size_t>::iterator lru_pos;
+		// 密文包中各通道密文和范数密文的 (偏移, 大小)
+		vector<pair<size_t, size_t>> cipher_ranges;
+		vector<pair<size_t, size_t>> norm_ranges;
+	};
+	void readDirectory();
+	void readPack();
+	void load(size_t index);
+	void deserialize(const Entry& entry, vector<Ciphertext>& ciphers, vector<double>& norms);
+	void install(size_t index, shared_ptr<const vector<Ciphertext>> ciphers, const vector<double>& norms);
+	void loadCiphers(const Entry& entry, vector<Ciphertext>& ciphers);
+	bool loadNorm(const Entry& entry, size_t channel, Ciphertext& norm);
+	void evict(size_t keep);
+
+	const CKKS& cryptor;
+	string store_path;
+	string parameter_header;
+	string preset_name;
+	unique_ptr<MappedFile> pack;
+	size_t memory_budget;
+	size_t memory_usage = 0;
+	size_t load_count = 0;
+	vector<Entry> entries;
+	list<size_t> lru;	// 表头为最近使用
+	mutex store_mutex;
+};
+
+/*
+批量打分用的密文块：每个通道一个密文，槽位 [k*span, (k+1)*span) 存放第 k 个候选图像该通道的像素，
+span 为不小于 h*w 的 2 的幂，同一批中的候选图像 span 和通道数相同。
+norm_ciphers 的槽位 k*span 为第 k 个候选该通道的平方范数，norms[c][k] 为其解密后的缓存。
+*/
+struct CipherBatch {
+	size_t span = 0;
+	vector<string> paths;
+	vector<Ciphertext> ciphers;
+	vector<Ciphertext> norm_ciphers;
+	vector<vector<double>> norms;
+};
+
+/*
+明文图像库：库内图像本身不需要保密时，每个通道保存为 NTT 形式的 Plaintext（CKKS::encodePlain），
+平方范数直接保存为明文 double；存储量约为密文库的一半，相似度计算不需要重线性化
+*/
+struct PlainDatabase {
+	vector<string> paths;
+	vector<vector<Plaintext>> plains;
+	vector<double> norms;
+};
+
+/*
+排序检索：对整个库打分，只保留相似度最高的 k 个候选（有界最小堆，堆顶为当前第 k 名），
+低于 threshold 的候选直接丢弃；结果与候选的遍历顺序无关，近似重复的图像也能排进结果
+*/
+struct SearchMatch {
+	string path;
+	double score = 0;
+};
+class TopK {
+public:
+	TopK(size_t k, double threshold = -numeric_limits<double>::infinity()) : k(k), threshold(threshold) {}
+	// score 能否进入当前的前 k 名（NaN 一律拒绝），调用方可据此避免构造不需要的路径字符串
+	bool accepts(double score) const;
+	void push(const string& path, double score);
+	void merge(const TopK& other);
+	// 按相似度从高到低排列的结果
+	vector<SearchMatch> sorted() const;
+private:
+	size_t k;
+	double threshold;
+	vector<SearchMatch> heap;
+};
+/*
+各阶段耗时（ms）：prepare 为查询范数、层级对齐或 replicate，load 为取候选密文，score 为同态计算和解密，
+rank 为堆操作与合并；多线程时 load/score/rank 为各线程耗时之和，total 为墙钟时间
+*/
+struct RankTiming {
+	double prepare_time = 0;
+	double load_time = 0;
+	double score_time = 0;
+	double rank_time = 0;
+	double total_time = 0;
+};
+struct RankResult {
+	vector<SearchMatch> matches;
+	size_t scored = 0;
+	RankTiming timing;
+};
+
+/*
+流水线检索中 I/O 线程与计算线程之间的有界队列：队列满时 push 阻塞（I/O 停顿），
+队列空且未关闭时 pop 阻塞（计算停顿）；close 之后 pop 取完剩余元素返回 false
+*/
+struct CandidateItem {
+	size_t index = 0;
+	shared_ptr<const vector<Ciphertext>> ciphers;
+	vector<double> norms;
+};
+class CandidateQueue {
+public:
+	CandidateQueue(size_t _capacity);
+	void push(CandidateItem item);
+	bool pop(CandidateItem& item);
+	void close();
+	size_t getPushStalls();
+	size_t getPopStalls();
+	size_t getMaxDepth();
+private:
+	size_t capacity;
+	bool closed = false;
+	size_t push_stalls = 0;
+	size_t pop_stalls = 0;
+	size_t max_depth = 0;
+	deque<CandidateItem> items;
+	mutex queue_mutex;
+	condition_variable not_full;
+	condition_variable not_empty;
+};
+/*
+流水线检索的统计：queue_depth 为队列容量，max_depth 为实际达到的最大深度；
+io_stalls 为 I/O 线程因队列满而等待的次数，eval_stalls 为计算线程因队列空而等待的次数，
+前者多说明计算是瓶颈，后者多说明载入是瓶颈
+*/
+struct PipelineStats {
+	size_t queue_depth = 0;
+	size_t max_depth = 0;
+	size_t io_stalls = 0;
+	size_t eval_stalls = 0;
+};
+
+size_t nextPowerOfTwo(size_t n);
+size_t getImagePixels(const string& str);
+void buildBatches(const CKKS& cryptor, const vector<string>& image_paths, vector<CipherBatch>& batches);
+void saveBatches(const CKKS& cryptor, const vector<CipherBatch>& batches, const string& dir);
+void loadBatches(const CKKS& cryptor, const string& dir, vector<CipherBatch>& batches);
+size_t ciphertextBytes(const Ciphertext& cipher);
+void loadImageCiphers(const CKKS& cryptor, const string& dir, vector<Ciphertext>& result);
+void search(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const string& image_dir, string& str, vector<Ciphertext>& result, double& count_time);
+void search(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, string& str, vector<Ciphertext>& result, double& count_time, size_t pixels = 0);
+void searchParallel(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, string& str, vector<Ciphertext>& result, double& count_time, size_t num_threads = 0, size_t pixels = 0);
+void searchBatched(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t pixels, const vector<CipherBatch>& batches, string& str, vector<Ciphertext>& result, double& count_time);
+void rankSearch(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, size_t k, double threshold, RankResult& result, size_t num_threads = 0, size_t pixels = 0);
+void rankSearchMulti(const CKKS& cryptor, const vector<vector<Ciphertext>>& queries, CipherStore& store, size_t k, double threshold, vector<RankResult>& results, size_t num_threads = 0, const vector<size_t>& pixels = vector<size_t>());
+void rankPipelined(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, size_t k, double threshold, RankResult& result, PipelineStats& stats, size_t io_threads = 1, size_t eval_threads = 0, size_t queue_depth = 16, size_t pixels = 0);
+void rankBatched(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t pixels, const vector<CipherBatch>& batches, size_t k, double threshold, RankResult& result);
+void buildPlainDatabase(const CKKS& cryptor, const vector<string>& image_paths, PlainDatabase& database);
+void savePlainDatabase(const CKKS& cryptor, const PlainDatabase& database, const string& dir);
+void loadPlainDatabase(const CKKS& cryptor, const string& dir, PlainDatabase& database);
+void searchPlain(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const PlainDatabase& database, string& str, vector<Plaintext>& result, double& count_time, size_t pixels = 0);
+/*
+用 CKKS::Circuit 计算查询与一批候选的图像级余弦相似度（平方范数也在密文下计算）：查询的平方范数只算一次，
+每个候选的各通道乘积累加后只做一次重线性化和 rescale，查询切换到候选层级的结果在整批候选之间共享。
+result[i] 对应 candidates[i]，通道数与查询不一致的候选为 0
+*/
+bool circuitSimilarity(const CKKS& cryptor, const vector<Ciphertext>& query, const vector<vector<Ciphertext>>& candidates, vector<double>& result, CircuitStats& stats, size_t span = 0);
+void evaluate(const CKKS& cryptor, const Ciphertext& cipher, double& add_time, double& mul_time, double& dot_time);
+void evaluateSumSlots(const CKKS& cryptor, const Ciphertext& cipher, size_t span, double& sum_time);
+/*
+各种入库序列化方式的对比：bytes 为单个密文序列化后的字节数，save_time 为加密加序列化的耗时，
+load_time 为从内存缓冲区反序列化的耗时（ms），load_throughput 为反序列化吞吐（MB/s）
+*/
+struct StorageStats {
+	string mode;
+	size_t bytes = 0;
+	double save_time = 0;
+	double load_time = 0;
+	double load_throughput = 0;
+};
+void evaluateStorage(const CKKS& cryptor, const vector<double>& input, vector<StorageStats>& result);
+bool verifyConcurrentDot(const CKKS& cryptor, const Ciphertext& cipher, size_t num_threads = 0);
+/*
+在 rows*cols 的随机 RGB 图像（默认 1000*1100，超过 1 MP）上验证分块入库：按 format 入库到 work_dir 下的临时密文包，
+用 CipherStore 载入后与分块加密的查询做 dotImage，与各块各通道明文 dot() 之和比较，相对误差超过 1e-3 时返回 false。
+默认的 format 与 main 入库时相同（最低层级），用于确认大图像的槽位求和没有超出 rescale 后剩余的模数
+*/
+bool verifyTiledDot(const CKKS& cryptor, const string& work_dir, int rows = 1000, int cols = 1100, const CipherFormat& format = CipherFormat{ true, compr_mode_type::zstd, true });
+/*
+在 count 幅 rows*cols 的随机 RGB 图像上验证批量打分：buildBatches 打包后，rankBatched 的每个分数与逐个加密的
+imageSimilarity 比较（绝对误差超过 1e-4 时返回 false），searchBatched 必须找到查询图像本身，且 extract 取出的块解密后与原图一致。
+默认 24*30 的图像 span 为 1024，默认参数下每批 4 幅，5 幅图像分为两批
+*/
+bool verifyBatchedScores(const CKKS& cryptor, const string& work_dir, size_t count = 5, int rows = 24, int cols = 30);
+// 预热后 rounds 次图像相似度计算中 Worker 内存池新分配的字节数，稳态下应为 0
+size_t steadyStateAllocations(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t rounds = 8);
\ No newline at end of file
@@ -1,119 +1,230 @@
-#include "examples.h"
-
-//string image_path = ".\\resources\\miku.png";
-int main() {
-    string image_path1 = ".\\resources\\images\\test_0.png";
-    string image_path2 = ".\\resources\\images\\test_1.png";
-    string enc_dir = ".\\resources\\ciphers";
-    string image_dir = ".\\resources\\images";
-    string key_path = ".\\resources\\key";
-
-    CKKS cryptor;
-    size_t slot_count = cryptor.getSlot();
-    cryptor.loadPrivate(key_path + "\\private");
-
-    vector<double> input;
-    input.reserve(slot_count);  // ָvectorĹ̶Сpush_backʱresizeЧ
-    double curr_point = 0;
-    double step_size = 1.0 / (static_cast<double>(slot_count) - 1); // 4096  0  1 ĸ
-    for (size_t i = 0; i < slot_count; i++)
-    {
-        input.push_back(curr_point);
-        curr_point += step_size;
-    }
-    Ciphertext encrpted;
-    double add_time, mul_time, dot_time;
-    cryptor.encrypt(input, encrpted);
-    evaluate(cryptor, encrpted, add_time, mul_time, dot_time);
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(10);
-    cout << "   / " << endl;
-    cout << "   | " << "average add_time: " << add_time<< "ms" << endl;
-    cout << "   | " << "average mul_time: " << mul_time << "ms" << endl;
-    cout << "   | " << "average dot_time: " << dot_time << "ms" << endl;
-    cout << "   \\ " << endl;
-    cout.copyfmt(old_fmt);
-
-    return 0;
-    // Ϊʱ
-    vector<string> image_paths;
-    getImagePath(image_dir, image_paths);
-
-    vector<double>enc_times;
-    //ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(10);
-    //  image_paths еͼ񣬱 enc_dir 
-    for (string& it : image_paths) {
-        vector<Ciphertext> image_ciphers;
-        long long start_time = getClockTime();
-        cryptor.enc_image(it, image_ciphers);
-        long long end_time = getClockTime();
-        double enc_time = static_cast<double>(end_time - start_time) / 1000000;
-
-        enc_times.push_back(enc_time);
-        cout << "encrypt time: " << enc_time << "ms" << endl;
-
-        fs::path image_path(it);
-        string filename = image_path.stem().string();
-        string save_dir = enc_dir + "\\" + filename;
-        create_directory(save_dir);
-
-        int i = 0;
-        for (Ciphertext& cipher : image_ciphers) {
-            string save_path = save_dir + "\\" + to_string(i) + ".dat";
-            cryptor.saveCiphertext(save_path, cipher);
-            i++;
-        }
-    }
-    double ave_enc_time = add_self(enc_times)/enc_times.size();
-    cout << "   /" << endl;
-    cout << "   | average encrypt time: " << ave_enc_time << "ms" << endl;
-    cout << "   \\" << endl;
-    // ͼмܣʹļenc_dir֮ƥͼ
-
-    vector<double> search_times;
-    vector<double> count_times;
-    for (string& it : image_paths) {
-        //vector<Ciphertext> image_ciphers;
-        vector<Ciphertext> ciphers, result;
-        string found_path;
-        cryptor.enc_image(it, ciphers);
-
-        // ƥͼ
-        double count_time;
-        long long start_time = getClockTime();
-        search(cryptor, ciphers, enc_dir, found_path, result, count_time);
-        long long end_time = getClockTime();
-        double search_time = static_cast<double>(end_time - start_time) / 1000000;
-        search_times.push_back(search_time);
-        count_times.push_back(count_time);
-        if (result.empty())
-        {
-            cout << "query image: " << it << " found no ciphers" << endl;
-            continue;
-        }
-        cout << "   /" << endl;
-        cout << "   | " << "query image: " << it << endl;
-        cout << "   | " << "found ciphers in: " << found_path << endl;
-        cout << "   | " << "search time: " << search_time << endl;
-        cout << "   | " << "Similarity calculate time: " << count_time << endl;
-        // ֤ҵͼǷȷ
-        vector<vector<double>> imageVector;
-        cryptor.dec_image(result, imageVector);
-        if (equalImage(it, imageVector))
-            cout << "   | " << "cipher found is right" << endl;
-        else
-            cout << "   | " << "cipher found is wrong" << endl;
-        cout << "   \\" << endl;
-    }
-    double ave_search_time = add_self(search_times) / search_times.size();
-    double ave_count_time = add_self(count_times) / count_times.size();
-    cout << "   /" << endl;
-    cout << "   | average search time: " << ave_search_time << "ms" << endl;
-    cout << "   | average similarity calculate time: " << ave_count_time << "ms" << endl;
-    cout << "   \\" << endl;
-    cout.copyfmt(old_fmt);
-    return 0;
+#include "examples.h"
+
+//string image_path = ".\\resources\\miku.png";
+int main() {
+    string image_path1 = ".\\resources\\images\\test_0.png";
+    string image_path2 = ".\\resources\\images\\test_1.png";
+    string enc_dir = ".\\resources\\ciphers";
+    string enc_pack = ".\\resources\\ciphers.pack";
+    string image_dir = ".\\resources\\images";
+    string plain_dir = ".\\resources\\plains";
+    string key_path = ".\\resources\\key";
+
+    // 密钥已保存在 key_path 中，直接载入，不再先生成一套随即被丢弃的密钥
+    long long startup_begin = getClockTime();
+    unique_ptr<CKKS> cryptor_ptr = CKKS::fromKeys(key_path);
+    CKKS& cryptor = *cryptor_ptr;
+    double startup_time = static_cast<double>(getClockTime() - startup_begin) / 1000000;
+    // 旧版本保存的 gal_keys.txt 含有全部步长：显式迁移为只含需要的步长（replicate/extract 的密钥移到 gal_keys_batch.txt），之后的启动只载入这些
+    if (!cryptor.migrateKeys(key_path)) {
+        return 1;
+    }
+    size_t slot_count = cryptor.getSlot();
+
+    vector<double> input;
+    input.reserve(slot_count);  // 指定vector的固定大小，比push_back时resize更高效
+    double curr_point = 0;
+    double step_size = 1.0 / (static_cast<double>(slot_count) - 1); // 创建4096 个从 0 到 1 的浮点数
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        input.push_back(curr_point);
+        curr_point += step_size;
+    }
+    Ciphertext encrpted;
+    double add_time, mul_time, dot_time;
+    cryptor.encrypt(input, encrpted);
+    evaluate(cryptor, encrpted, add_time, mul_time, dot_time);
+    // 多个线程共享同一个 CKKS 和同一个密文并发计算 dot，结果与单线程不一致或输入密文被修改时直接退出
+    bool concurrent_ok = verifyConcurrentDot(cryptor, encrpted);
+    if (!concurrent_ok) {
+        cerr << "Error: concurrent dot does not match the single-threaded result" << endl;
+        return 1;
+    }
+    // 超过 1 MP 的随机图像按 main 的入库方式（最低层级）入库，与明文 dot() 比较，确认分块图像的槽位求和没有溢出
+    if (!verifyTiledDot(cryptor, ".\\resources")) {
+        cerr << "Error: tiled dot of a large image does not match the plaintext dot" << endl;
+        return 1;
+    }
+    // 批量打包的候选：replicate/dotBatch 的分数与逐个计算的 imageSimilarity 一致，extract 能取回原图
+    if (!verifyBatchedScores(cryptor, ".\\resources")) {
+        cerr << "Error: batched scores do not match imageSimilarity" << endl;
+        return 1;
+    }
+    ios old_fmt(nullptr);
+    old_fmt.copyfmt(cout);
+    cout << fixed << setprecision(10);
+    cout << "   / " << endl;
+    cout << "   | " << "startup time: " << startup_time << "ms" << endl;
+    cout << "   | " << "parameters: " << cryptor.parameterHeader() << ", preset for test image: " << selectPresetForImage(image_path1).name << endl;
+    cout << "   | " << "average add_time: " << add_time<< "ms" << endl;
+    cout << "   | " << "average mul_time: " << mul_time << "ms" << endl;
+    cout << "   | " << "average dot_time: " << dot_time << "ms" << endl;
+    cout << "   | " << "concurrent dot: " << (concurrent_ok ? "passed" : "failed") << endl;
+    cout << "   | " << "tiled dot (>1 MP): passed" << endl;
+    cout << "   | " << "batched scores: passed" << endl;
+    for (size_t span = 64; span <= slot_count; span <<= 3) {
+        double sum_time;
+        evaluateSumSlots(cryptor, encrpted, span, sum_time);
+        cout << "   | " << "sum " << span << " slots: " << sum_time << "ms" << endl;
+    }
+    cout << "   | " << "steady-state allocations: " << steadyStateAllocations(cryptor, { encrpted }) << " bytes" << endl;
+    cout << "   \\ " << endl;
+    vector<StorageStats> storage_stats;
+    evaluateStorage(cryptor, input, storage_stats);
+    cout << "   / " << endl;
+    for (StorageStats& stats : storage_stats) {
+        cout << "   | " << stats.mode << ": " << stats.bytes << " bytes, save " << stats.save_time << "ms, load "
+            << stats.load_time << "ms (" << stats.load_throughput << " MB/s)" << endl;
+    }
+    cout << "   \\ " << endl;
+    cout.copyfmt(old_fmt);
+
+    return 0;
+    // 以上为计算时间测试
+    vector<string> image_paths;
+    getImagePath(image_dir, image_paths);
+    // 按库内图像的存储布局（每个通道的 h*w）选择参数预设，入库和检索都用这组参数，
+    // 密钥保存在 key_path\\<预设名> 下，预设名记录在密文包索引的头部
+    const ParamPreset& preset = selectPresetForImages(image_paths);
+    unique_ptr<CKKS> image_cryptor_ptr = CKKS::fromPresetKeys(key_path, preset);
+    CKKS& image_cryptor = *image_cryptor_ptr;
+    cout << "image preset: " << preset.name << " (" << image_cryptor.parameterHeader() << ")" << endl;
+
+    //ios old_fmt(nullptr);
+    old_fmt.copyfmt(cout);
+    cout << fixed << setprecision(10);
+    // 增量加密 image_paths 中的图像，保存在单文件密文包 enc_pack 中（索引为 enc_pack.idx，清单为 enc_pack.manifest），
+    // 只加密新增或内容变化的图像；使用私钥对称加密（只保存种子）并用 zstd 压缩，且保存在相似度计算可用的最低层级
+    IngestStats ingest_stats;
+    if (!ingestImages(image_cryptor, image_paths, enc_pack, enc_dir, CipherFormat{ true, compr_mode_type::zstd, true }, ingest_stats)) {
+        return 1;
+    }
+    cout << "   /" << endl;
+    cout << "   | added: " << ingest_stats.added << ", updated: " << ingest_stats.updated
+        << ", unchanged: " << ingest_stats.unchanged << ", removed: " << ingest_stats.removed << ", failed: " << ingest_stats.failed << endl;
+    cout << "   | encrypt time: " << ingest_stats.encrypt_time << "ms" << endl;
+    cout << "   \\" << endl;
+    // 对所有图像进行加密，使用密文检索enc_dir下与之相匹配的图像
+
+    // 密文包内存映射后常驻内存，后续查询不再重复读盘
+    CipherStore store(image_cryptor, enc_pack);
+
+    // 统计检索过程中各操作的耗时分布，并记录每次检索的 trace
+    Metrics::instance().reset();
+    Metrics::instance().enable(true, true);
+    vector<double> search_times;
+    vector<double> count_times;
+    for (string& it : image_paths) {
+        //vector<Ciphertext> image_ciphers;
+        vector<Ciphertext> ciphers, result;
+        string found_path;
+        // 分块加密，大于 slot_count 个像素的图像也可以查询
+        image_cryptor.enc_image_tiled(it, ciphers);
+        size_t pixels = getImagePixels(it);
+
+        // 查找匹配图像
+        double count_time;
+        long long start_time = getClockTime();
+        searchParallel(image_cryptor, ciphers, store, found_path, result, count_time, 0, pixels);
+        long long end_time = getClockTime();
+        double search_time = static_cast<double>(end_time - start_time) / 1000000;
+        search_times.push_back(search_time);
+        count_times.push_back(count_time);
+        if (result.empty())
+        {
+            cout << "query image: " << it << " found no ciphers" << endl;
+            continue;
+        }
+        cout << "   /" << endl;
+        cout << "   | " << "query image: " << it << endl;
+        cout << "   | " << "found ciphers in: " << found_path << endl;
+        cout << "   | " << "search time: " << search_time << endl;
+        cout << "   | " << "Similarity calculate time: " << count_time << endl;
+        // 验证查找到的图像是否正确
+        vector<vector<double>> imageVector;
+        size_t tiles = (pixels + image_cryptor.getSlot() - 1) / image_cryptor.getSlot();
+        image_cryptor.dec_image_tiled(result, result.size() / tiles, pixels, imageVector);
+        if (equalImage(it, imageVector))
+            cout << "   | " << "cipher found is right" << endl;
+        else
+            cout << "   | " << "cipher found is wrong" << endl;
+        cout << "   \\" << endl;
+    }
+    double ave_search_time = add_self(search_times) / search_times.size();
+    double ave_count_time = add_self(count_times) / count_times.size();
+    cout << "   /" << endl;
+    cout << "   | average search time: " << ave_search_time << "ms" << endl;
+    cout << "   | average similarity calculate time: " << ave_count_time << "ms" << endl;
+    cout << "   \\" << endl;
+    Metrics::instance().report(cout);
+    Metrics::instance().writeTrace(".\\resources\\search.trace.json");
+    Metrics::instance().enable(false);
+
+    // 一批查询一起处理：库只遍历一次，每个候选与全部查询打分
+    vector<vector<Ciphertext>> queries;
+    vector<size_t> query_pixels;
+    for (string& it : image_paths) {
+        vector<Ciphertext> ciphers;
+        image_cryptor.enc_image_tiled(it, ciphers);
+        queries.push_back(ciphers);
+        query_pixels.push_back(getImagePixels(it));
+    }
+    vector<RankResult> rank_results;
+    rankSearchMulti(image_cryptor, queries, store, 5, 0.9, rank_results, 0, query_pixels);
+    for (size_t q = 0; q < rank_results.size(); q++) {
+        cout << "query image: " << image_paths[q] << endl;
+        for (const SearchMatch& match : rank_results[q].matches) {
+            cout << "   | " << match.score << " " << match.path << endl;
+        }
+    }
+    if (!rank_results.empty()) {
+        cout << "batch search time: " << rank_results[0].timing.total_time << "ms" << endl;
+    }
+
+    // 延迟求值的电路：查询与前几个候选一起打分，查询的平方范数只计算一次
+    if (!queries.empty()) {
+        vector<vector<Ciphertext>> circuit_candidates;
+        for (size_t i = 0; i < store.size() && i < 8; i++) {
+            circuit_candidates.push_back(*store.get(i));
+        }
+        vector<double> circuit_scores;
+        CircuitStats circuit_stats;
+        long long start = getClockTime();
+        if (circuitSimilarity(image_cryptor, queries[0], circuit_candidates, circuit_scores, circuit_stats, nextPowerOfTwo(query_pixels[0]))) {
+            cout << "   /" << endl;
+            cout << "   | circuit similarity time: " << static_cast<double>(getClockTime() - start) / 1000000 << "ms for " << circuit_candidates.size() << " candidates" << endl;
+            cout << "   | multiplies: " << circuit_stats.multiplies << ", relinearizations: " << circuit_stats.relinearizations
+                << ", rescales: " << circuit_stats.rescales << ", rotations: " << circuit_stats.rotations
+                << ", mod switches: " << circuit_stats.mod_switches << ", reused: " << circuit_stats.reused << endl;
+            for (size_t i = 0; i < circuit_scores.size(); i++) {
+                cout << "   | " << store.path(i) << ": " << circuit_scores[i] << endl;
+            }
+            cout << "   \\" << endl;
+        }
+    }
+
+    // 明文库模式：库内图像不保密时编码为明文保存，只有查询图像加密
+    PlainDatabase database;
+    buildPlainDatabase(image_cryptor, image_paths, database);
+    savePlainDatabase(image_cryptor, database, plain_dir);
+    vector<double> plain_count_times;
+    for (string& it : image_paths) {
+        vector<Ciphertext> ciphers;
+        vector<Plaintext> result;
+        string found_path;
+        image_cryptor.enc_image(it, ciphers);
+        double count_time;
+        searchPlain(image_cryptor, ciphers, database, found_path, result, count_time, getImagePixels(it));
+        if (result.empty()) {
+            cout << "query image: " << it << " found no plaintext image" << endl;
+            continue;
+        }
+        plain_count_times.push_back(count_time);
+        cout << "query image: " << it << " found plaintext image: " << found_path << endl;
+    }
+    cout << "   /" << endl;
+    cout << "   | average plaintext similarity calculate time: " << add_self(plain_count_times) / plain_count_times.size() << "ms" << endl;
+    cout << "   \\" << endl;
+    cout.copyfmt(old_fmt);
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "../examples.h"
+
+/*
+相似度阈值的精度/延迟调参工具，与 main.cpp 一样作为独立的可执行文件（tools/tuner.cpp + utils.cpp，单独的工程），
+有自己的 main，放在 tools/ 下，不会被根目录的 *.cpp 与 main.cpp 一起编译。
+对每组候选参数（环维数、系数模数、尺度）加密样本图像，计算所有图像对的图像级内积与余弦相似度，
+与 utils.cpp 中明文 dot() 的结果对比，输出最大/平均误差和单次相似度的耗时；
+以明文相似度是否超过阈值作为真值，选出仍能正确区分匹配与不匹配的最快的一组参数。
+用法：tuner [图像目录] [样本数] [阈值] [输出 JSON 路径]
+*/
+
+struct TuneResult {
+    string name;
+    size_t pairs = 0;
+    double max_dot_error = 0;    // 内积的相对误差
+    double mean_dot_error = 0;
+    double max_error = 0;        // 余弦相似度的绝对误差
+    double mean_error = 0;
+    double min_match = 1;        // 明文判为匹配的图像对中密文相似度的最小值
+    double max_mismatch = -1;    // 明文判为不匹配的图像对中密文相似度的最大值
+    size_t misclassified = 0;
+    size_t skipped = 0;          // 这组参数放不下（CKKS::fitsImage 为 false）、没有参与比较的图像数
+    double similarity_time = 0;  // 单次 imageSimilarity 的平均耗时（ms）
+    // 有图像放不下的参数不能用于这批图像
+    bool separates() const {
+        return misclassified == 0 && skipped == 0 && pairs != 0;
+    }
+};
+
+/*
+候选参数：三组预设，以及只留一层乘法深度、尺度依次减小的 N8192 参数（相似度电路只需要一次乘法）。
+解密前密文位于第一个素数上，其位数减去尺度的位数决定了内积能表示的最大值，大图像在小模数下会溢出，误差会直接体现在结果中
+*/
+static vector<ParamPreset> candidateParameters() {
+    vector<ParamPreset> candidates = CKKS::presets();
+    candidates.push_back({ "N8192/d1/s40", 8192, { 60, 40, 60 }, 40 });
+    candidates.push_back({ "N8192/d1/s30", 8192, { 50, 30, 50 }, 30 });
+    candidates.push_back({ "N8192/d1/s25", 8192, { 45, 25, 45 }, 25 });
+    return candidates;
+}
+// 各通道内积之和，与 dotImage 对应的明文参考值；只用于 h*w 和通道数都相同的图像
+static double plainImageDot(const vector<vector<double>>& image1, const vector<vector<double>>& image2) {
+    double ret = 0;
+    for (size_t c = 0; c < image1.size() && c < image2.size(); c++) {
+        ret += dot(image1[c], image2[c]);
+    }
+    return ret;
+}
+static TuneResult tuneParameters(const ParamPreset& preset, const vector<Mat>& images, const vector<vector<vector<double>>>& plains, double threshold) {
+    TuneResult result;
+    result.name = preset.name;
+    unique_ptr<CKKS> cryptor = CKKS::fromPreset(preset);
+    /*
+    查询与库内图像分别加密，同一幅图像的两份密文互相独立；与实际检索一致，
+    库内图像的平方范数由入库时的范数密文解密得到，查询图像的平方范数用 selfDot 计算
+    */
+    vector<vector<Ciphertext>> queries(images.size()), database(images.size());
+    vector<double> query_norms(images.size()), database_norms(images.size());
+    vector<bool> usable(images.size(), false);
+    vector<Ciphertext> norms;
+    vector<double> decrypted;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (!cryptor->enc_image_tiled(images[i], queries[i], norms) || !cryptor->enc_image_tiled(images[i], database[i], norms)) {
+            result.skipped++;
+            continue;
+        }
+        usable[i] = true;
+        for (size_t c = 0; c < queries[i].size(); c++) {
+            query_norms[i] += cryptor->selfDot(queries[i][c]);
+            cryptor->decrypt(norms[c], decrypted);
+            database_norms[i] += decrypted[0];
+        }
+    }
+    Ciphertext product;
+    double total_dot_error = 0, total_error = 0, total_time = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (!usable[i]) {
+            continue;
+        }
+        double plain_norm1 = plainImageDot(plains[i], plains[i]);
+        for (size_t j = 0; j < images.size(); j++) {
+            // 检索只比较同样大小的图像，尺寸或通道数不同的图像对没有明文参考值，不参与比较
+            if (!usable[j] || plains[i].size() != plains[j].size() || plains[i][0].size() != plains[j][0].size()) {
+                continue;
+            }
+            double plain_dot = plainImageDot(plains[i], plains[j]);
+            double plain_score = plain_dot / sqrt(plain_norm1 * plainImageDot(plains[j], plains[j]));
+            long long start = getClockTime();
+            double score = cryptor->imageSimilarity(queries[i], database[j], query_norms[i], database_norms[j]);
+            total_time += static_cast<double>(getClockTime() - start) / 1000000;
+            cryptor->dotImage(queries[i], database[j], product);
+            cryptor->decrypt(product, decrypted);
+            double dot_error = fabs(decrypted[0] - plain_dot) / max(fabs(plain_dot), 1e-12);
+            double error = fabs(score - plain_score);
+            result.max_dot_error = max(result.max_dot_error, dot_error);
+            result.max_error = max(result.max_error, error);
+            total_dot_error += dot_error;
+            total_error += error;
+            if (plain_score > threshold) {
+                result.min_match = min(result.min_match, score);
+            } else {
+                result.max_mismatch = max(result.max_mismatch, score);
+            }
+            if ((plain_score > threshold) != (score > threshold)) {
+                result.misclassified++;
+            }
+            result.pairs++;
+        }
+    }
+    if (result.pairs != 0) {
+        result.mean_dot_error = total_dot_error / result.pairs;
+        result.mean_error = total_error / result.pairs;
+        result.similarity_time = total_time / result.pairs;
+    }
+    return result;
+}
+static void writeJson(const string& path, const vector<TuneResult>& results, double threshold, const string& chosen) {
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Unable to open the file for writing: " << path << endl;
+        return;
+    }
+    out << setprecision(9);
+    out << "{\n  \"threshold\": " << threshold << ",\n  \"chosen\": \"" << chosen << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const TuneResult& r = results[i];
+        out << "    { \"params\": \"" << r.name << "\", \"pairs\": " << r.pairs
+            << ", \"max_dot_error\": " << r.max_dot_error << ", \"mean_dot_error\": " << r.mean_dot_error
+            << ", \"max_error\": " << r.max_error << ", \"mean_error\": " << r.mean_error
+            << ", \"min_match\": " << r.min_match << ", \"max_mismatch\": " << r.max_mismatch
+            << ", \"misclassified\": " << r.misclassified << ", \"skipped\": " << r.skipped << ", \"similarity_ms\": " << r.similarity_time << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+int main(int argc, char* argv[]) {
+    string image_dir = argc > 1 ? argv[1] : ".\\resources\\images";
+    size_t samples = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 16;
+    double threshold = argc > 3 ? atof(argv[3]) : image_similarity_threshold;
+    string json_path = argc > 4 ? argv[4] : "tuner.json";
+
+    vector<string> image_paths;
+    getImagePath(image_dir, image_paths);
+    vector<Mat> images;
+    vector<vector<vector<double>>> plains;
+    for (const string& path : image_paths) {
+        if (images.size() == samples) {
+            break;
+        }
+        Mat image = imread(path);
+        if (image.empty()) {
+            continue;
+        }
+        vector<vector<double>> plain;
+        getImageVector(image, plain);
+        images.push_back(image);
+        plains.push_back(plain);
+    }
+    if (images.empty()) {
+        cerr << "Error: no image in " << image_dir << endl;
+        return 1;
+    }
+
+    vector<TuneResult> results;
+    const TuneResult* chosen = nullptr;
+    cout << scientific << setprecision(3);
+    cout << "   / " << images.size() << " images, threshold " << threshold << endl;
+    for (const ParamPreset& preset : candidateParameters()) {
+        results.push_back(tuneParameters(preset, images, plains, threshold));
+    }
+    for (const TuneResult& r : results) {
+        cout << "   | " << setw(14) << r.name << "  " << r.pairs << " pairs  dot error max " << r.max_dot_error << " mean " << r.mean_dot_error
+            << "  similarity error max " << r.max_error << " mean " << r.mean_error
+            << "  " << fixed << r.similarity_time << "ms  " << (r.separates() ? "separates" : "misclassified " + to_string(r.misclassified))
+            << (r.skipped != 0 ? ", skipped " + to_string(r.skipped) + " images" : "") << scientific << endl;
+        if (r.separates() && (chosen == nullptr || r.similarity_time < chosen->similarity_time)) {
+            chosen = &r;
+        }
+    }
+    cout << "   \\" << endl;
+    if (chosen == nullptr) {
+        cout << "no candidate separates matches from non-matches at threshold " << threshold << endl;
+    } else {
+        // 阈值可以在 (max_mismatch, min_match) 之间任取，样本中没有不匹配的图像对时 max_mismatch 为 -1
+        cout << fixed << setprecision(6) << "cheapest separating parameters: " << chosen->name << ", " << chosen->similarity_time
+            << "ms per similarity, matches >= " << chosen->min_match << ", non-matches <= " << chosen->max_mismatch << endl;
+    }
+    writeJson(json_path, results, threshold, chosen == nullptr ? "" : chosen->name);
+    cout << "results written to " << json_path << endl;
+    return 0;
+}
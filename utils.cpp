@@ -1,336 +1,2598 @@
-#include "examples.h"
-
-void ImageShow(String str) {
-    Mat image = imread(str);
-
-    // ͼǷɹ
-    if (image.empty()) {
-        std::cerr << "Error: Could not read the image." << std::endl;
-        return;
-    }
-    int height = image.rows;
-    int width = image.cols;
-    int channel = image.channels();
-
-    int window_height = 600;
-    int window_width = static_cast<int>(window_height * ((float)width / height));
-    // һɵСĴ
-    namedWindow("Resizable Window", WINDOW_NORMAL);
-
-    resizeWindow("Resizable Window", window_width, window_height);
-
-    // ʾͼ
-    imshow("Resizable Window", image);
-    waitKey(0);
-}
-
-void mul(const vector<double>& vector_1, const vector<double>& vector_2, vector<double>&result) {
-    if (vector_1.size() != vector_2.size()) {
-        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
-        result = vector<double>();
-    }
-    for (size_t i = 0; i < vector_1.size(); i++)
-    {
-        double x = vector_1[i];
-        double y = vector_2[i];
-        result.push_back(x * y);
-    }
-}
-double dot(const vector<double>& vector_1, const vector<double>& vector_2) {
-    if (vector_1.size() != vector_2.size()) {
-        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
-        return 0;
-    }
-    vector<double> result;
-    mul(vector_1, vector_2, result);
-    double sum = accumulate(result.begin(), result.end(), 0.0);
-    return sum;
-}
-void add(const vector<double>& vector_1, const vector<double>& vector_2, vector<double>& result) {
-    if (vector_1.size() != vector_2.size()) {
-        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
-        result = vector<double>();
-    }
-    for (size_t i = 0; i < vector_1.size(); i++)
-    {
-        double x = vector_1[i];
-        double y = vector_2[i];
-        result.push_back(x + y);
-    }
-}
-double add_self(const vector<double>& vector) {
-    double ret = 0.0;
-    for (auto& num : vector) {
-        ret += num;
-    }
-    return ret;
-}
-bool isImage(string path) {
-    vector<string> types = { ".jpg", ".jpeg", ".png", ".bmp", ".gif" };
-    string fileExtension = fs::path(path).extension().string();
-    transform(fileExtension.begin(), fileExtension.end(), fileExtension.begin(), ::tolower);
-    return find(types.begin(), types.end(), fileExtension) != types.end();
-}
-void getImagePath(const string &dir, vector<string>&imagePaths) {
-    try {
-        for (const auto& entry : directory_iterator(dir)) {
-            string path = entry.path().string();
-            if (isImage(path)) {
-                imagePaths.push_back(path);
-            }
-        }
-    }
-    catch (const filesystem_error& e) {
-        cerr << "Error: " << e.what() << endl;
-    }
-}
-void getImageVector(const string& str, vector<vector<double>>& result) {
-    if (!isImage(str)) {
-        cout << "Error (not an image): " << str << endl;
-        result = vector<vector<double>>();
-        return;
-    }
-    Mat image = imread(str);
-    if (image.empty()) {
-        cerr << "Error: can't read image" << endl;
-        result = vector<vector<double>>();
-        return;
-    }
-    int height = image.rows;
-    int width = image.cols;
-    if (height * width > 4096) {
-        cerr << "Error: image is too big" << endl;
-        result = vector<vector<double>>();
-        return;
-    }
-    int channel = image.channels();
-    if(!result.empty())
-        result.clear();  // ȷresultΪ
-
-    if (channel == 1 || channel == 3 || channel == 4) {
-        result.resize(channel, std::vector<double>());  // ʼ result ĵһά
-    }
-    else {
-        cerr << "Error: Unsupported number of channels (" << channel << ")" << endl;
-        result = vector<vector<double>>();
-        return;
-    }
-
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            if (channel == 1) {
-                result[0].push_back(static_cast<double>(image.at<uchar>(i, j))/255);
-            }
-            else if (channel == 3) {
-                Vec3b pixel = image.at<Vec3b>(i, j);
-                for (int c = 0; c < channel; ++c) {
-                    result[c].push_back(static_cast<double>(pixel[c]) / 255);
-                }
-            }
-            else if (channel == 4) {
-                Vec4b pixel = image.at<Vec4b>(i, j);
-                for (int c = 0; c < channel; ++c) {
-                    result[c].push_back(static_cast<double>(pixel[c]) / 255);
-                }
-            }
-        }
-    }
-}
-void getFilePath(const string& dir, vector<string>& Paths) {
-    try {
-        for (const auto& entry : directory_iterator(dir)) {
-            string path = entry.path().string();
-            Paths.push_back(path);
-        }
-    }
-    catch (const filesystem_error& e) {
-        cerr << "Error: " << e.what() << endl;
-    }
-}
-void getSubDir(const string& dir, vector<string>& Paths) {
-    if (is_directory(dir)) {
-        try {
-            for (const auto& entry : directory_iterator(dir)) {
-                if (is_directory(entry.status())) {
-                    string temp = entry.path().string();
-                    Paths.push_back(temp);
-                }
-            }
-        }
-        catch (const fs::filesystem_error& ex) {
-            std::cerr << "Error accessing directory: " << ex.what() << std::endl;
-        }
-    }
-    else {
-        cerr << "Invalid directory path." << endl;
-    }
-}
-bool equalImage(const string& str, const vector<vector<double>>& input) {
-    if (!isImage(str) || input.empty()) {
-        cout << "Error (not an image): " << str << endl;
-        return false;
-    }
-    Mat image = imread(str);
-    if (image.empty()) {
-        cerr << "Error: can't read image" << endl;
-        return false;
-    }
-    int height = image.rows;
-    int width = image.cols;
-    int channel = image.channels();
-    if (input[0].size() < height * width || channel != input.size()) {
-        cout << "size is not same" << endl;
-        return false;
-    }
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            if (channel == 1) {
-                if (image.at<uchar>(i, j) != static_cast<uchar>(round(input[0][i * width + j] * 255))) {
-                    return false;
-                }
-            }
-            else if (channel == 3) {
-                Vec3b pixel = image.at<Vec3b>(i, j);
-                for (int c = 0; c < channel; ++c) {
-                    if (pixel[c] != static_cast<uchar>(round(input[c][i * width + j] * 255))) {
-                        /*ios old_fmt(nullptr);
-                        old_fmt.copyfmt(cout);
-                        cout << fixed << setprecision(10);
-                        cout << "not same at (" << i << ", " << j << ") " << (int)pixel[c] << "  " << input[c][i * width + j] * 255 << endl;
-                        cout.copyfmt(old_fmt);*/
-                        return false;
-                    }
-                }
-            }
-            else if (channel == 4) {
-                Vec4b pixel = image.at<Vec4b>(i, j);
-                for (int c = 0; c < channel; ++c) {
-                    if (pixel[c] != static_cast<uchar>(round(input[c][i * width + j] * 255))) {
-                        return false;
-                    }
-                }
-            }
-        }
-    }
-    return true;
-}
-bool equalImage(const vector<vector<double>>& image1, const vector<vector<double>>& image2) {
-    if (image1.size() != image2.size() || image1[0].size() != image2[0].size()) {
-        return false;
-    }
-    int rows = (int)image1.size();
-    int cols = (int)image1[0].size();
-    for (int i = 0; i < rows; ++i) {
-        for (int j = 0; j < cols; ++j) {
-            if (round(image1[i][j]*255) != round(image2[i][j]*255))
-                return false;
-        }
-    }
-    return true;
-}
-bool equalImage(const string& str1, const string& str2) {
-    if (!isImage(str1) || !isImage(str2)) {
-        cerr << "Error: input is not an image" << endl;
-        return false;
-    }
-    Mat image1 = imread(str1);
-    Mat image2 = imread(str2);
-    if (image1.empty() || image2.empty()) {
-        std::cerr << "Error loading images." << std::endl;
-        return false;
-    }
-    Mat diff;
-    absdiff(image1, image2, diff);
-
-    // ͼķ
-    double normValue = norm(diff);
-    // һֵСֵΪͼ
-    double threshold = 0.0;
-    return (normValue == threshold);
-}
-
-double cosineImageSimilarity(CKKS& cryptor, vector<Ciphertext>& ciphers, const string& image_dir, vector<Ciphertext>& result) {
-    vector<string> image_paths;
-    getFilePath(image_dir, image_paths);
-    auto image_path = image_paths.begin();
-    auto cipher = ciphers.begin();
-    double ret = 1.0;
-    while (image_path != image_paths.end() && cipher != ciphers.end()) {
-        Ciphertext temp;
-        cryptor.loadCiphertext(*image_path, temp);
-        result.push_back(temp);
-        double cos_s = cryptor.cosineSimilarity(*cipher, temp);
-        if (cos_s < 0.999) {
-            result = vector<Ciphertext>();
-            return 0;
-        }
-        ret *= cos_s;
-        image_path++;
-        cipher++;
-    }
-    return ret;
-}
-long long getClockTime() {
-    // ȡǰ߷ֱʱ
-    auto currentTimePoint = std::chrono::high_resolution_clock::now();
-
-    // ǰʱתΪʱΪλ
-    auto timestamp = std::chrono::time_point_cast<std::chrono::nanoseconds>(currentTimePoint).time_since_epoch().count();
-
-    // ʱ
-    //std::cout << "High-resolution Timestamp: " << timestamp << " ns" << std::endl;
-    return timestamp;
-}
-void search(CKKS& cryptor, vector<Ciphertext>& ciphers, const string& image_dir, string& str, vector<Ciphertext>& result, double& count_time) {
-    if (ciphers.empty()) {
-        cerr << "Error: input is empty" << endl;
-        str = "";
-        result = vector<Ciphertext>();
-        return;
-    }
-    vector<string> cipher_dir;
-    getSubDir(image_dir, cipher_dir);
-    for (auto& dir : cipher_dir) {
-        long long start = getClockTime();
-        double cos_s = cosineImageSimilarity(cryptor, ciphers, dir, result);
-        long long end = getClockTime();
-        /*ios old_fmt(nullptr);
-        old_fmt.copyfmt(cout);
-        cout << fixed << setprecision(10);
-        cout << cos_s << endl;
-        cout.copyfmt(old_fmt);*/
-        if (cos_s > 0.9999) {
-            str = dir;
-            count_time = static_cast<double>(end - start) / 1000000;
-            return;
-        }
-    }
-    str = "";
-    result = vector<Ciphertext>();
-}
-void evaluate(CKKS& cryptor, Ciphertext& cipher, double& add_time, double& mul_time, double& dot_time) {
-    Ciphertext result;
-    vector<double> add_times;
-    vector<double> mul_times;
-    vector<double> dot_times;
-    for (int i = 0; i < 1000; i++) {
-        long long time_0 = getClockTime();
-        for (int j = 0; j < 1000; j++) {
-            cryptor.add(cipher, cipher, result);
-        }
-        long long time_1 = getClockTime();
-        cryptor.mul_vector(cipher, cipher, result);
-        long long time_2 = getClockTime();
-        cryptor.dot(cipher, cipher, result);
-        long long time_3 = getClockTime();
-        double add = static_cast<double>(time_1 - time_0) / 1000000000;
-        double mul = static_cast<double>(time_2 - time_1) / 1000000;
-        double dot = static_cast<double>(time_3 - time_2) / 1000000;
-        add_times.push_back(add);
-        mul_times.push_back(mul);
-        dot_times.push_back(dot);
-    }
-    add_time = add_self(add_times) / add_times.size();
-    mul_time = add_self(mul_times) / mul_times.size();
-    dot_time = add_self(dot_times) / dot_times.size();
+#include "examples.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void ImageShow(String str) {
+    Mat image = imread(str);
+
+    // 检查图像是否成功加载
+    if (image.empty()) {
+        std::cerr << "Error: Could not read the image." << std::endl;
+        return;
+    }
+    int height = image.rows;
+    int width = image.cols;
+    int channel = image.channels();
+
+    int window_height = 600;
+    int window_width = static_cast<int>(window_height * ((float)width / height));
+    // 创建一个可调整大小的窗口
+    namedWindow("Resizable Window", WINDOW_NORMAL);
+
+    resizeWindow("Resizable Window", window_width, window_height);
+
+    // 显示图像
+    imshow("Resizable Window", image);
+    waitKey(0);
+}
+
+void mul(const vector<double>& vector_1, const vector<double>& vector_2, vector<double>&result) {
+    if (vector_1.size() != vector_2.size()) {
+        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
+        result = vector<double>();
+    }
+    for (size_t i = 0; i < vector_1.size(); i++)
+    {
+        double x = vector_1[i];
+        double y = vector_2[i];
+        result.push_back(x * y);
+    }
+}
+double dot(const vector<double>& vector_1, const vector<double>& vector_2) {
+    if (vector_1.size() != vector_2.size()) {
+        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
+        return 0;
+    }
+    vector<double> result;
+    mul(vector_1, vector_2, result);
+    double sum = accumulate(result.begin(), result.end(), 0.0);
+    return sum;
+}
+void add(const vector<double>& vector_1, const vector<double>& vector_2, vector<double>& result) {
+    if (vector_1.size() != vector_2.size()) {
+        std::cerr << "Error: Vectors must have the same size for addition." << std::endl;
+        result = vector<double>();
+    }
+    for (size_t i = 0; i < vector_1.size(); i++)
+    {
+        double x = vector_1[i];
+        double y = vector_2[i];
+        result.push_back(x + y);
+    }
+}
+double add_self(const vector<double>& vector) {
+    double ret = 0.0;
+    for (auto& num : vector) {
+        ret += num;
+    }
+    return ret;
+}
+bool isImage(string path) {
+    vector<string> types = { ".jpg", ".jpeg", ".png", ".bmp", ".gif" };
+    string fileExtension = fs::path(path).extension().string();
+    transform(fileExtension.begin(), fileExtension.end(), fileExtension.begin(), ::tolower);
+    return find(types.begin(), types.end(), fileExtension) != types.end();
+}
+void getImagePath(const string &dir, vector<string>&imagePaths) {
+    try {
+        for (const auto& entry : directory_iterator(dir)) {
+            string path = entry.path().string();
+            if (isImage(path)) {
+                imagePaths.push_back(path);
+            }
+        }
+    }
+    catch (const filesystem_error& e) {
+        cerr << "Error: " << e.what() << endl;
+    }
+}
+/*
+像素转换内核：把 count 个交错存放的 C 通道 8 位像素拆分到各通道并归一化到 [0, 1]。
+通道数为模板参数，内层循环没有分支，每个通道的输出是连续写入的，编译器可以向量化
+*/
+template <size_t C>
+static void deinterleaveKernel(const uchar* src, size_t count, double* const* dst) {
+    for (size_t c = 0; c < C; c++) {
+        double* out = dst[c];
+        const uchar* in = src + c;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = static_cast<double>(in[i * C]) / 255;
+        }
+    }
+}
+void deinterleavePixels(const uchar* src, size_t count, size_t channel, double* const* dst) {
+    switch (channel) {
+    case 1:
+        deinterleaveKernel<1>(src, count, dst);
+        break;
+    case 3:
+        deinterleaveKernel<3>(src, count, dst);
+        break;
+    case 4:
+        deinterleaveKernel<4>(src, count, dst);
+        break;
+    default:
+        break;
+    }
+}
+// 把 image 的第 c 个通道写入 dst[c][0, h*w)，按行指针遍历，数据连续时整幅图像一次转换
+bool deinterleaveImage(const Mat& image, double* const* dst) {
+    size_t channel = image.channels();
+    if (image.depth() != CV_8U || (channel != 1 && channel != 3 && channel != 4)) {
+        cerr << "Error: Unsupported number of channels (" << channel << ")" << endl;
+        return false;
+    }
+    size_t height = image.rows;
+    size_t width = image.cols;
+    if (image.isContinuous()) {
+        deinterleavePixels(image.ptr<uchar>(0), height * width, channel, dst);
+        return true;
+    }
+    double* row_dst[4];
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t c = 0; c < channel; c++) {
+            row_dst[c] = dst[c] + i * width;
+        }
+        deinterleavePixels(image.ptr<uchar>(static_cast<int>(i)), width, channel, row_dst);
+    }
+    return true;
+}
+// result 的容量会被复用，调用方反复传入同一个 result 时不会重新分配内存
+void getImageVector(const Mat& image, vector<vector<double>>& result) {
+    size_t channel = image.channels();
+    size_t pixels = static_cast<size_t>(image.rows) * image.cols;
+    result.resize(min<size_t>(channel, 4));
+    double* dst[4];
+    for (size_t c = 0; c < result.size(); c++) {
+        result[c].resize(pixels);
+        dst[c] = result[c].data();
+    }
+    if (!deinterleaveImage(image, dst)) {
+        result = vector<vector<double>>();
+    }
+}
+void getImageVector(const string& str, vector<vector<double>>& result, size_t max_pixels) {
+    if (!isImage(str)) {
+        cout << "Error (not an image): " << str << endl;
+        result = vector<vector<double>>();
+        return;
+    }
+    Mat image = imread(str);
+    if (image.empty()) {
+        cerr << "Error: can't read image" << endl;
+        result = vector<vector<double>>();
+        return;
+    }
+    size_t pixels = static_cast<size_t>(image.rows) * image.cols;
+    if (pixels > max_pixels) {
+        cerr << "Error: image is too big (" << pixels << " pixels, one ciphertext holds " << max_pixels << "), use enc_image_tiled" << endl;
+        result = vector<vector<double>>();
+        return;
+    }
+    getImageVector(image, result);
+}
+/*
+按块流式读取图像：按行优先顺序每 tile_size 个像素为一块，每块对每个通道调用一次 visit，最后一块不足时补 0。
+像素的取值和通道顺序与 getImageVector 相同，但没有 4096 像素的限制；各通道的块缓冲区为线程局部变量，
+同一线程处理后续图像时直接复用，行内的像素按段交给 deinterleavePixels 转换
+*/
+bool forEachImageTile(const Mat& image, size_t tile_size, const function<void(size_t tile, size_t channel, const vector<double>& pixels)>& visit) {
+    size_t channel = image.channels();
+    if (image.depth() != CV_8U || (channel != 1 && channel != 3 && channel != 4)) {
+        cerr << "Error: Unsupported number of channels (" << channel << ")" << endl;
+        return false;
+    }
+    thread_local vector<vector<double>> tile;
+    tile.resize(channel);
+    for (size_t c = 0; c < channel; c++) {
+        tile[c].assign(tile_size, 0.0);
+    }
+    // 数据连续时把整幅图像看作一行
+    size_t rows = image.isContinuous() ? 1 : image.rows;
+    size_t cols = image.isContinuous() ? static_cast<size_t>(image.rows) * image.cols : image.cols;
+    size_t filled = 0, index = 0;
+    double* dst[4];
+    for (size_t i = 0; i < rows; ++i) {
+        const uchar* row = image.ptr<uchar>(static_cast<int>(i));
+        for (size_t j = 0; j < cols; ) {
+            size_t count = min(tile_size - filled, cols - j);
+            for (size_t c = 0; c < channel; c++) {
+                dst[c] = tile[c].data() + filled;
+            }
+            deinterleavePixels(row + j * channel, count, channel, dst);
+            filled += count;
+            j += count;
+            if (filled == tile_size) {
+                for (size_t c = 0; c < channel; ++c) {
+                    visit(index, c, tile[c]);
+                }
+                filled = 0;
+                index++;
+            }
+        }
+    }
+    if (filled != 0) {
+        for (size_t c = 0; c < channel; ++c) {
+            fill(tile[c].begin() + filled, tile[c].end(), 0.0);
+            visit(index, c, tile[c]);
+        }
+    }
+    return true;
+}
+bool forEachImageTile(const string& str, size_t tile_size, const function<void(size_t tile, size_t channel, const vector<double>& pixels)>& visit) {
+    if (!isImage(str)) {
+        cout << "Error (not an image): " << str << endl;
+        return false;
+    }
+    Mat image = imread(str);
+    if (image.empty()) {
+        cerr << "Error: can't read image" << endl;
+        return false;
+    }
+    return forEachImageTile(image, tile_size, visit);
+}
+/*
+随机读取第 tile 块：按行优先顺序的像素 [tile * tile_size, (tile + 1) * tile_size) 写入 result[c]，最后一块不足时补 0，
+与 forEachImageTile 的第 tile 块相同；不依赖前面的块，多个线程可以同时读取同一幅图像的不同块
+*/
+bool getImageTile(const Mat& image, size_t tile_size, size_t tile, vector<vector<double>>& result) {
+    size_t channel = image.channels();
+    if (image.depth() != CV_8U || (channel != 1 && channel != 3 && channel != 4)) {
+        cerr << "Error: Unsupported number of channels (" << channel << ")" << endl;
+        return false;
+    }
+    result.resize(channel);
+    for (size_t c = 0; c < channel; c++) {
+        result[c].assign(tile_size, 0.0);
+    }
+    size_t cols = image.cols;
+    size_t begin = tile * tile_size;
+    size_t end = min(begin + tile_size, static_cast<size_t>(image.rows) * cols);
+    double* dst[4];
+    for (size_t p = begin; p < end; ) {
+        size_t i = p / cols, j = p % cols;
+        size_t count = min(end - p, cols - j);
+        for (size_t c = 0; c < channel; c++) {
+            dst[c] = result[c].data() + (p - begin);
+        }
+        deinterleavePixels(image.ptr<uchar>(static_cast<int>(i)) + j * channel, count, channel, dst);
+        p += count;
+    }
+    return true;
+}
+void getFilePath(const string& dir, vector<string>& Paths) {
+    try {
+        for (const auto& entry : directory_iterator(dir)) {
+            string path = entry.path().string();
+            Paths.push_back(path);
+        }
+    }
+    catch (const filesystem_error& e) {
+        cerr << "Error: " << e.what() << endl;
+    }
+}
+void getSubDir(const string& dir, vector<string>& Paths) {
+    if (is_directory(dir)) {
+        try {
+            for (const auto& entry : directory_iterator(dir)) {
+                if (is_directory(entry.status())) {
+                    string temp = entry.path().string();
+                    Paths.push_back(temp);
+                }
+            }
+        }
+        catch (const fs::filesystem_error& ex) {
+            std::cerr << "Error accessing directory: " << ex.what() << std::endl;
+        }
+    }
+    else {
+        cerr << "Invalid directory path." << endl;
+    }
+}
+bool equalImage(const string& str, const vector<vector<double>>& input) {
+    if (!isImage(str) || input.empty()) {
+        cout << "Error (not an image): " << str << endl;
+        return false;
+    }
+    Mat image = imread(str);
+    if (image.empty()) {
+        cerr << "Error: can't read image" << endl;
+        return false;
+    }
+    int height = image.rows;
+    int width = image.cols;
+    int channel = image.channels();
+    if (input[0].size() < height * width || channel != input.size()) {
+        cout << "size is not same" << endl;
+        return false;
+    }
+    for (int i = 0; i < height; ++i) {
+        for (int j = 0; j < width; ++j) {
+            if (channel == 1) {
+                if (image.at<uchar>(i, j) != static_cast<uchar>(round(input[0][i * width + j] * 255))) {
+                    return false;
+                }
+            }
+            else if (channel == 3) {
+                Vec3b pixel = image.at<Vec3b>(i, j);
+                for (int c = 0; c < channel; ++c) {
+                    if (pixel[c] != static_cast<uchar>(round(input[c][i * width + j] * 255))) {
+                        /*ios old_fmt(nullptr);
+                        old_fmt.copyfmt(cout);
+                        cout << fixed << setprecision(10);
+                        cout << "not same at (" << i << ", " << j << ") " << (int)pixel[c] << "  " << input[c][i * width + j] * 255 << endl;
+                        cout.copyfmt(old_fmt);*/
+                        return false;
+                    }
+                }
+            }
+            else if (channel == 4) {
+                Vec4b pixel = image.at<Vec4b>(i, j);
+                for (int c = 0; c < channel; ++c) {
+                    if (pixel[c] != static_cast<uchar>(round(input[c][i * width + j] * 255))) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+bool equalImage(const vector<vector<double>>& image1, const vector<vector<double>>& image2) {
+    if (image1.size() != image2.size() || image1[0].size() != image2[0].size()) {
+        return false;
+    }
+    int rows = (int)image1.size();
+    int cols = (int)image1[0].size();
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            if (round(image1[i][j]*255) != round(image2[i][j]*255))
+                return false;
+        }
+    }
+    return true;
+}
+bool equalImage(const string& str1, const string& str2) {
+    if (!isImage(str1) || !isImage(str2)) {
+        cerr << "Error: input is not an image" << endl;
+        return false;
+    }
+    Mat image1 = imread(str1);
+    Mat image2 = imread(str2);
+    if (image1.empty() || image2.empty()) {
+        std::cerr << "Error loading images." << std::endl;
+        return false;
+    }
+    Mat diff;
+    absdiff(image1, image2, diff);
+
+    // 计算差异图像的范数
+    double normValue = norm(diff);
+    // 设置一个阈值，如果范数小于阈值，认为图像相等
+    double threshold = 0.0;
+    return (normValue == threshold);
+}
+
+double cosineImageSimilarity(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const string& image_dir, vector<Ciphertext>& result) {
+    vector<string> image_paths;
+    getFilePath(image_dir, image_paths);
+    auto image_path = image_paths.begin();
+    auto cipher = ciphers.begin();
+    double ret = 1.0;
+    while (image_path != image_paths.end() && cipher != ciphers.end()) {
+        if (fs::path(*image_path).extension() != ".dat") {
+            image_path++;
+            continue;
+        }
+        Ciphertext temp;
+        cryptor.loadCiphertext(*image_path, temp);
+        result.push_back(temp);
+        double cos_s = cryptor.cosineSimilarity(*cipher, temp);
+        if (cos_s < 0.999) {
+            result = vector<Ciphertext>();
+            return 0;
+        }
+        ret *= cos_s;
+        image_path++;
+        cipher++;
+    }
+    return ret;
+}
+double cosineImageSimilarity(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const vector<double>& norms, const vector<Ciphertext>& candidates, const vector<double>& candidate_norms, size_t span) {
+    if (ciphers.size() != candidates.size() || candidates.size() != candidate_norms.size()) {
+        return 0;
+    }
+    TraceSpan trace("similarity");
+    // 各通道融合为整幅图像的余弦相似度，每个候选只解密一次
+    return cryptor.imageSimilarity(ciphers, candidates, add_self(norms), add_self(candidate_norms), span);
+}
+double cosineImageSimilarity(CKKS::Worker& worker, const vector<Ciphertext>& ciphers, const vector<double>& norms, const vector<Ciphertext>& candidates, const vector<double>& candidate_norms, size_t span) {
+    if (ciphers.size() != candidates.size() || candidates.size() != candidate_norms.size()) {
+        return 0;
+    }
+    TraceSpan trace("similarity");
+    // 各通道融合为整幅图像的余弦相似度，每个候选只解密一次
+    return worker.imageSimilarity(ciphers, candidates, add_self(norms), add_self(candidate_norms), span);
+}
+// 不小于 n 的最小的 2 的幂
+size_t nextPowerOfTwo(size_t n) {
+    size_t ret = 1;
+    while (ret < n) {
+        ret <<= 1;
+    }
+    return ret;
+}
+// 图像的像素数 h*w，读取失败时返回 0
+size_t getImagePixels(const string& str) {
+    Mat image = imread(str);
+    return image.empty() ? 0 : static_cast<size_t>(image.rows) * image.cols;
+}
+void buildBatches(const CKKS& cryptor, const vector<string>& image_paths, vector<CipherBatch>& batches) {
+    size_t slot_count = cryptor.getSlot();
+    // 按 (span, 通道数) 分组，同一组内的图像可以放进同一批密文
+    map<pair<size_t, size_t>, vector<pair<string, vector<vector<double>>>>> groups;
+    for (const string& path : image_paths) {
+        vector<vector<double>> image;
+        getImageVector(path, image, slot_count);
+        if (image.empty()) {
+            continue;
+        }
+        size_t span = nextPowerOfTwo(image[0].size());
+        groups[{ span, image.size() }].push_back({ path, image });
+    }
+    for (auto& group : groups) {
+        size_t span = group.first.first;
+        size_t channel = group.first.second;
+        auto& images = group.second;
+        // 一个块就放不下的图像（小参数预设下 span 可能超过 slot_count）不能批量打包，per_batch 为 0 时也不能前进
+        if (span > slot_count) {
+            cerr << "Error: " << images.size() << " images need " << span << " slots per channel, more than the " << slot_count
+                << " slots of one ciphertext, skipped batching them" << endl;
+            continue;
+        }
+        size_t per_batch = slot_count / span;
+        for (size_t begin = 0; begin < images.size(); begin += per_batch) {
+            size_t end = min(images.size(), begin + per_batch);
+            CipherBatch batch;
+            batch.span = span;
+            batch.norms.resize(channel);
+            for (size_t c = 0; c < channel; c++) {
+                vector<double> slots(slot_count, 0.0);
+                vector<double> norm_slots(slot_count, 0.0);
+                for (size_t k = 0; k < end - begin; k++) {
+                    const vector<double>& pixels = images[begin + k].second[c];
+                    copy(pixels.begin(), pixels.end(), slots.begin() + k * span);
+                    norm_slots[k * span] = dot(pixels, pixels);
+                    batch.norms[c].push_back(norm_slots[k * span]);
+                }
+                Ciphertext cipher, norm;
+                cryptor.encrypt(slots, cipher);
+                cryptor.encrypt(norm_slots, norm);
+                batch.ciphers.push_back(cipher);
+                batch.norm_ciphers.push_back(norm);
+            }
+            for (size_t k = begin; k < end; k++) {
+                batch.paths.push_back(images[k].first);
+            }
+            batches.push_back(batch);
+        }
+    }
+}
+/*
+每一批保存在 dir\<batch>\ 下：index.txt 第一行为 span，其后每行一个候选图像路径；
+<channel>.dat 和 <channel>.norm 为各通道的密文和范数密文
+*/
+void saveBatches(const CKKS& cryptor, const vector<CipherBatch>& batches, const string& dir) {
+    create_directories(dir);
+    for (size_t b = 0; b < batches.size(); b++) {
+        const CipherBatch& batch = batches[b];
+        string batch_dir = dir + "\\" + to_string(b);
+        create_directory(batch_dir);
+        ofstream index(batch_dir + "\\index.txt");
+        index << batch.span << "\n";
+        for (const string& path : batch.paths) {
+            index << path << "\n";
+        }
+        for (size_t c = 0; c < batch.ciphers.size(); c++) {
+            cryptor.saveCiphertext(batch_dir + "\\" + to_string(c) + ".dat", batch.ciphers[c]);
+            cryptor.saveCiphertext(batch_dir + "\\" + to_string(c) + ".norm", batch.norm_ciphers[c]);
+        }
+    }
+}
+void loadBatches(const CKKS& cryptor, const string& dir, vector<CipherBatch>& batches) {
+    vector<string> batch_dirs;
+    getSubDir(dir, batch_dirs);
+    sort(batch_dirs.begin(), batch_dirs.end());
+    for (const string& batch_dir : batch_dirs) {
+        ifstream index(batch_dir + "\\index.txt");
+        CipherBatch batch;
+        if (!(index >> batch.span)) {
+            cerr << "Error: broken batch index in " << batch_dir << endl;
+            continue;
+        }
+        string line;
+        getline(index, line);
+        while (getline(index, line)) {
+            if (!line.empty()) {
+                batch.paths.push_back(line);
+            }
+        }
+        loadImageCiphers(cryptor, batch_dir, batch.ciphers);
+        for (size_t c = 0; c < batch.ciphers.size(); c++) {
+            Ciphertext norm;
+            cryptor.loadCiphertext(batch_dir + "\\" + to_string(c) + ".norm", norm);
+            vector<double> vec;
+            cryptor.decrypt(norm, vec);
+            batch.norm_ciphers.push_back(norm);
+            batch.norms.push_back(vector<double>());
+            for (size_t k = 0; k < batch.paths.size(); k++) {
+                batch.norms[c].push_back(vec[k * batch.span]);
+            }
+        }
+        batches.push_back(batch);
+    }
+}
+size_t ciphertextBytes(const Ciphertext& cipher) {
+    return cipher.size() * cipher.coeff_modulus_size() * cipher.poly_modulus_degree() * sizeof(uint64_t);
+}
+void loadImageCiphers(const CKKS& cryptor, const string& dir, vector<Ciphertext>& result) {
+    // 按通道编号顺序载入 0.dat, 1.dat, ...
+    for (int i = 0; ; i++) {
+        string cipher_path = dir + "\\" + to_string(i) + ".dat";
+        if (!exists(cipher_path)) {
+            break;
+        }
+        Ciphertext temp;
+        cryptor.loadCiphertext(cipher_path, temp);
+        result.push_back(temp);
+    }
+}
+MappedFile::MappedFile(const string& path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        cerr << "Unable to open the file for mapping: " << path << endl;
+        return;
+    }
+    file_handle = file;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        return;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        cerr << "Unable to map the file: " << path << endl;
+        return;
+    }
+    map_handle = mapping;
+    data_ptr = static_cast<const seal_byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    data_size = data_ptr ? static_cast<size_t>(file_size.QuadPart) : 0;
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Unable to open the file for mapping: " << path << endl;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return;
+    }
+    void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        cerr << "Unable to map the file: " << path << endl;
+        return;
+    }
+    data_ptr = static_cast<const seal_byte*>(addr);
+    data_size = static_cast<size_t>(st.st_size);
+#endif
+}
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data_ptr) {
+        UnmapViewOfFile(data_ptr);
+    }
+    if (map_handle) {
+        CloseHandle(map_handle);
+    }
+    if (file_handle) {
+        CloseHandle(file_handle);
+    }
+#else
+    if (data_ptr) {
+        munmap(const_cast<seal_byte*>(data_ptr), data_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+// 密文包数据文件开头的标识，之后为 8 字节的代数
+static const char pack_magic[8] = { 'C', 'I', 'P', 'H', 'P', 'A', 'C', 'K' };
+CipherPackWriter::CipherPackWriter(const string& _pack_path, const CipherFormat& _format, const string& header, const string& preset)
+    : pack_path(_pack_path), format(_format), data(_pack_path, ios::binary | ios::trunc), index(_pack_path + ".idx", ios::trunc) {
+    if (!data.is_open() || !index.is_open()) {
+        cerr << "Unable to open the file for writing: " << pack_path << endl;
+        return;
+    }
+    random_device device;
+    uint64_t generation = (static_cast<uint64_t>(device()) << 32) ^ device() ^ static_cast<uint64_t>(getClockTime());
+    data.write(pack_magic, sizeof(pack_magic));
+    data.write(reinterpret_cast<const char*>(&generation), sizeof(generation));
+    offset = pack_header_size;
+    index << "# generation " << hex << generation << dec << "\n";
+    index << "# format " << formatHeader(format) << "\n";
+    if (!header.empty()) {
+        index << "# params " << header << "\n";
+    }
+    if (!preset.empty()) {
+        index << "# preset " << preset << "\n";
+    }
+}
+size_t CipherPackWriter::append(const Ciphertext& cipher) {
+    size_t size = static_cast<size_t>(cipher.save(data, format.compr_mode));
+    offset += size;
+    return size;
+}
+size_t CipherPackWriter::appendFile(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) {
+        return 0;
+    }
+    data << file.rdbuf();
+    size_t size = static_cast<size_t>(file_size(path));
+    offset += size;
+    return size;
+}
+void CipherPackWriter::add(const string& name, const vector<Ciphertext>& ciphers, const vector<Ciphertext>& norms) {
+    index << ciphers.size();
+    for (size_t i = 0; i < ciphers.size(); i++) {
+        size_t cipher_offset = offset;
+        size_t cipher_size = append(ciphers[i]);
+        size_t norm_offset = offset;
+        size_t norm_size = i < norms.size() ? append(norms[i]) : 0;
+        index << " " << cipher_offset << " " << cipher_size << " " << norm_offset << " " << norm_size;
+    }
+    index << " " << name << "\n";
+}
+void CipherPackWriter::addImage(const CKKS& cryptor, const string& name, const vector<vector<double>>& image) {
+    index << image.size();
+    for (const vector<double>& channel : image) {
+        size_t cipher_offset = offset;
+        size_t cipher_size = cryptor.encryptTo(channel, data, format, image.size());
+        offset += cipher_size;
+        size_t norm_offset = offset;
+        size_t norm_size = cryptor.encryptSelfDotTo(channel, data, format);
+        offset += norm_size;
+        index << " " << cipher_offset << " " << cipher_size << " " << norm_offset << " " << norm_size;
+    }
+    index << " " << name << "\n";
+}
+void CipherPackWriter::addDirectory(const string& dir) {
+    vector<pair<size_t, size_t>> ranges;
+    for (int i = 0; ; i++) {
+        string cipher_path = dir + "\\" + to_string(i) + ".dat";
+        if (!exists(cipher_path)) {
+            break;
+        }
+        size_t cipher_offset = offset;
+        size_t cipher_size = appendFile(cipher_path);
+        size_t norm_offset = offset;
+        size_t norm_size = appendFile(dir + "\\" + to_string(i) + ".norm");
+        ranges.push_back({ cipher_offset, cipher_size });
+        ranges.push_back({ norm_offset, norm_size });
+    }
+    index << ranges.size() / 2;
+    for (auto& range : ranges) {
+        index << " " << range.first << " " << range.second;
+    }
+    index << " " << dir << "\n";
+}
+void CipherPackWriter::addSerialized(const string& name, const vector<string>& ciphers, const vector<string>& norms) {
+    beginImage(ciphers.size());
+    for (size_t i = 0; i < ciphers.size(); i++) {
+        appendSerialized(ciphers[i], i < norms.size() ? norms[i] : string());
+    }
+    endImage(name);
+}
+void CipherPackWriter::beginImage(size_t count) {
+    index << count;
+}
+void CipherPackWriter::appendSerialized(const string& cipher, const string& norm) {
+    size_t cipher_offset = offset;
+    data.write(cipher.data(), cipher.size());
+    offset += cipher.size();
+    size_t norm_offset = offset;
+    if (!norm.empty()) {
+        data.write(norm.data(), norm.size());
+        offset += norm.size();
+    }
+    index << " " << cipher_offset << " " << cipher.size() << " " << norm_offset << " " << norm.size();
+}
+void CipherPackWriter::endImage(const string& name) {
+    index << " " << name << "\n";
+}
+void CipherPackWriter::close() {
+    if (data.is_open()) {
+        data.close();
+    }
+    if (index.is_open()) {
+        index.close();
+    }
+}
+void packCiphers(const string& cipher_dir, const string& pack_path) {
+    vector<string> dirs;
+    getSubDir(cipher_dir, dirs);
+    sort(dirs.begin(), dirs.end());
+    CipherPackWriter writer(pack_path);
+    for (string& dir : dirs) {
+        writer.addDirectory(dir);
+    }
+}
+string formatHeader(const CipherFormat& format) {
+    const char* compr = format.compr_mode == compr_mode_type::zstd ? "zstd" : format.compr_mode == compr_mode_type::zlib ? "zlib" : "none";
+    return string(format.seeded ? "seeded/" : "public/") + compr + (format.lowest_level ? "/lowest" : "");
+}
+bool packGenerationMatches(const MappedFile& pack, const string& generation) {
+    if (generation.empty()) {
+        return true;
+    }
+    if (!pack.is_open() || pack.size() < pack_header_size || memcmp(pack.data(), pack_magic, sizeof(pack_magic)) != 0) {
+        return false;
+    }
+    uint64_t stored = 0;
+    memcpy(&stored, pack.data() + sizeof(pack_magic), sizeof(stored));
+    uint64_t expected = 0;
+    istringstream in(generation);
+    return static_cast<bool>(in >> hex >> expected) && stored == expected;
+}
+bool parsePackIndexLine(const string& line, PackIndexEntry& entry) {
+    istringstream in(line);
+    size_t channel = 0;
+    in >> channel;
+    for (size_t i = 0; i < channel; i++) {
+        size_t cipher_offset, cipher_size, norm_offset, norm_size;
+        in >> cipher_offset >> cipher_size >> norm_offset >> norm_size;
+        entry.cipher_ranges.push_back({ cipher_offset, cipher_size });
+        entry.norm_ranges.push_back({ norm_offset, norm_size });
+    }
+    in >> ws;
+    getline(in, entry.name);
+    return !in.fail();
+}
+const ParamPreset& selectPresetForImage(const string& str, size_t depth) {
+    return CKKS::selectPreset(isImage(str) ? getImagePixels(str) : 0, depth);
+}
+const ParamPreset& selectPresetForImages(const vector<string>& image_paths, size_t depth) {
+    size_t slots = 0;
+    for (const string& path : image_paths) {
+        if (isImage(path)) {
+            slots = max(slots, getImagePixels(path));
+        }
+    }
+    return CKKS::selectPreset(slots, depth);
+}
+uint64_t fileHash(const string& path) {
+    // 64 位 FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    ifstream file(path, ios::binary);
+    vector<char> buffer(1 << 16);
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        streamsize count = file.gcount();
+        for (streamsize i = 0; i < count; i++) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+// 用 num_threads 个线程对 [0, count) 中的每个下标调用 work
+static void parallelFor(size_t count, size_t num_threads, const function<void(size_t)>& work) {
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (size_t t = 0; t < min(num_threads, count); t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                work(i);
+            }
+        });
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+}
+bool ingestImages(const CKKS& cryptor, const vector<string>& image_paths, const string& pack_path, const string& name_dir, const CipherFormat& format, IngestStats& stats, size_t num_threads) {
+    stats = IngestStats();
+    if (num_threads == 0) {
+        num_threads = max<size_t>(1, thread::hardware_concurrency());
+    }
+    string index_path = pack_path + ".idx";
+    string manifest_path = pack_path + ".manifest";
+
+    // 读取旧的清单和索引，名称 -> 内容哈希 / 索引条目
+    map<string, uint64_t> old_hashes;
+    ifstream old_manifest(manifest_path);
+    string line;
+    while (getline(old_manifest, line)) {
+        // 以制表符分隔，名称和路径中可以有空格
+        istringstream in(line);
+        uint64_t hash;
+        string name;
+        if (in >> hex >> hash && in.get() == '\t' && getline(in, name, '\t')) {
+            old_hashes[name] = hash;
+        }
+    }
+    old_manifest.close();
+    map<string, PackIndexEntry> old_entries;
+    ifstream old_index(index_path);
+    string header = "# params " + cryptor.parameterHeader();
+    string format_header = formatHeader(format);
+    string old_generation, old_format;
+    while (getline(old_index, line)) {
+        if (!line.empty() && line[0] == '#') {
+            if (line.compare(0, 13, "# generation ") == 0) {
+                old_generation = line.substr(13);
+            }
+            if (line.compare(0, 9, "# format ") == 0) {
+                old_format = line.substr(9);
+            }
+            // 加密参数变化后旧的密文不能再用，全部重新加密
+            if (line.compare(0, 9, "# params ") == 0 && line != header) {
+                old_entries.clear();
+                break;
+            }
+            continue;
+        }
+        PackIndexEntry entry;
+        if (parsePackIndexLine(line, entry)) {
+            old_entries[entry.name] = entry;
+        }
+    }
+    old_index.close();
+    // 入库方式变化（或旧索引没有记录入库方式）时，未变化的图像也按新的方式重新加密，包中不会混有两种格式
+    if (!old_entries.empty() && old_format != format_header) {
+        cout << "Note: cipher format of " << pack_path << " changed from " << (old_format.empty() ? "unknown" : old_format)
+            << " to " << format_header << ", re-encrypting all images" << endl;
+        old_entries.clear();
+    }
+    // 旧索引与旧密文包不是同一次写入的（上次替换到一半时中断），旧条目全部作废
+    unique_ptr<MappedFile> old_pack;
+    if (!old_entries.empty()) {
+        old_pack = make_unique<MappedFile>(pack_path);
+        if (!packGenerationMatches(*old_pack, old_generation)) {
+            cerr << "Warning: " << index_path << " does not match " << pack_path << ", re-encrypting all images" << endl;
+            old_entries.clear();
+            old_pack.reset();
+        }
+    }
+    // 失败时删除已经写出的临时文件，旧的密文包、索引和清单保持不变
+    auto remove_temp = [&]() {
+        error_code ignored;
+        remove(pack_path + ".tmp", ignored);
+        remove(pack_path + ".tmp.idx", ignored);
+        remove(manifest_path + ".tmp", ignored);
+    };
+
+    long long start = getClockTime();
+    size_t count = image_paths.size();
+    vector<string> names(count);
+    vector<uint64_t> hashes(count);
+    parallelFor(count, num_threads, [&](size_t i) {
+        names[i] = name_dir + "\\" + path(image_paths[i]).filename().string();
+        hashes[i] = fileHash(image_paths[i]);
+    });
+    stats.hash_time = static_cast<double>(getClockTime() - start) / 1000000;
+
+    // 需要重新加密的图像；加密成功后才计入 added/updated
+    vector<size_t> dirty;
+    vector<bool> is_dirty(count, false);
+    vector<bool> is_new(count, false);
+    for (size_t i = 0; i < count; i++) {
+        auto hash = old_hashes.find(names[i]);
+        if (hash == old_hashes.end() || hash->second != hashes[i] || old_entries.find(names[i]) == old_entries.end()) {
+            dirty.push_back(i);
+            is_dirty[i] = true;
+            is_new[i] = hash == old_hashes.end();
+        }
+        else {
+            stats.unchanged++;
+        }
+    }
+    vector<string> sorted_names = names;
+    sort(sorted_names.begin(), sorted_names.end());
+    for (auto& entry : old_entries) {
+        if (!binary_search(sorted_names.begin(), sorted_names.end(), entry.first)) {
+            stats.removed++;
+        }
+    }
+
+    // 先原样复制未变化的条目，再加密并流式写入新增或变化的图像
+    long long write_start = getClockTime();
+    {
+        CipherPackWriter writer(pack_path + ".tmp", format, cryptor.parameterHeader(), cryptor.presetName());
+        ofstream manifest(manifest_path + ".tmp", ios::trunc);
+        // 把旧密文包中名为 name 的条目原样复制到新包，旧包已损坏时返回 false
+        auto copy_old = [&](const string& name) {
+            const PackIndexEntry& old = old_entries[name];
+            vector<string> ciphers, norms;
+            for (size_t c = 0; c < old.cipher_ranges.size(); c++) {
+                if (!old_pack->is_open() || old.cipher_ranges[c].first + old.cipher_ranges[c].second > old_pack->size()
+                    || old.norm_ranges[c].first + old.norm_ranges[c].second > old_pack->size()) {
+                    cerr << "Error: broken cipher pack " << pack_path << endl;
+                    return false;
+                }
+                const char* base = reinterpret_cast<const char*>(old_pack->data());
+                ciphers.push_back(string(base + old.cipher_ranges[c].first, old.cipher_ranges[c].second));
+                norms.push_back(string(base + old.norm_ranges[c].first, old.norm_ranges[c].second));
+            }
+            writer.addSerialized(name, ciphers, norms);
+            return true;
+        };
+        for (size_t i = 0; i < count; i++) {
+            if (is_dirty[i]) {
+                continue;
+            }
+            if (!copy_old(names[i])) {
+                writer.close();
+                manifest.close();
+                remove_temp();
+                return false;
+            }
+            manifest << hex << hashes[i] << dec << "\t" << names[i] << "\t" << image_paths[i] << "\n";
+        }
+        /*
+        新增或变化的图像每次并行解码 num_threads 幅，加密任务为 (图像, 块, 通道)，按 CKKS::enc_image_tiled 的布局排列；
+        每批 window 个任务分给各线程加密，按顺序流式写入密文包后再加密下一批。内存中只保留这几幅图像解码后的 8 位像素
+        和一批序列化的密文，大图像的各块也由多个线程并行加密
+        */
+        struct TileTask {
+            size_t image;
+            size_t tile;
+            size_t channel;
+        };
+        size_t slot_count = cryptor.getSlot();
+        size_t window = num_threads * 4;
+        vector<string> ciphers(window), norms(window);
+        for (size_t begin = 0; begin < dirty.size(); begin += num_threads) {
+            size_t end = min(begin + num_threads, dirty.size());
+            long long decode_start = getClockTime();
+            vector<Mat> images(end - begin);
+            parallelFor(end - begin, num_threads, [&](size_t d) {
+                const string& image_path = image_paths[dirty[begin + d]];
+                Mat image = isImage(image_path) ? imread(image_path) : Mat();
+                size_t channel = image.channels();
+                if (image.empty() || image.depth() != CV_8U || (channel != 1 && channel != 3 && channel != 4)) {
+                    cerr << "Error: can't read image " << image_path << endl;
+                    return;
+                }
+                // 槽位求和在所有层级都会溢出的图像不入库，否则相似度是错误的值且没有任何提示
+                if (cryptor.fitsImage(image)) {
+                    images[d] = image;
+                }
+            });
+            stats.encrypt_time += static_cast<double>(getClockTime() - decode_start) / 1000000;
+            /*
+            读取失败或过大的图像没有任务，计入 failed：旧包中有该图像时原样保留旧的条目，清单中也保留旧的哈希，
+            与文件内容的哈希不一致，下次入库时重试；没有旧条目时不写入清单，同样会重试
+            */
+            vector<TileTask> tasks;
+            vector<size_t> image_ciphers(end - begin, 0);
+            for (size_t d = 0; d < end - begin; d++) {
+                if (images[d].empty()) {
+                    size_t i = dirty[begin + d];
+                    stats.failed++;
+                    if (old_entries.find(names[i]) != old_entries.end()) {
+                        if (!copy_old(names[i])) {
+                            writer.close();
+                            manifest.close();
+                            remove_temp();
+                            return false;
+                        }
+                        auto hash = old_hashes.find(names[i]);
+                        if (hash != old_hashes.end()) {
+                            manifest << hex << hash->second << dec << "\t" << names[i] << "\t" << image_paths[i] << "\n";
+                        }
+                    }
+                    continue;
+                }
+                size_t pixels = static_cast<size_t>(images[d].rows) * images[d].cols;
+                size_t channel = images[d].channels();
+                image_ciphers[d] = cryptor.tileCiphers(pixels, channel);
+                for (size_t t = 0; t * slot_count < pixels; t++) {
+                    for (size_t c = 0; c < channel; c++) {
+                        tasks.push_back({ d, t, c });
+                    }
+                }
+            }
+            for (size_t first = 0; first < tasks.size(); first += window) {
+                size_t last = min(first + window, tasks.size());
+                long long encrypt_start = getClockTime();
+                parallelFor(last - first, num_threads, [&](size_t k) {
+                    const TileTask& task = tasks[first + k];
+                    // 每个任务转换整块的所有通道，只加密其中一个；转换的开销远小于加密
+                    thread_local vector<vector<double>> pixels;
+                    getImageTile(images[task.image], slot_count, task.tile, pixels);
+                    ostringstream cipher_out, norm_out;
+                    cryptor.encryptTo(pixels[task.channel], cipher_out, format, image_ciphers[task.image]);
+                    cryptor.encryptSelfDotTo(pixels[task.channel], norm_out, format);
+                    ciphers[k] = cipher_out.str();
+                    norms[k] = norm_out.str();
+                });
+                stats.encrypt_time += static_cast<double>(getClockTime() - encrypt_start) / 1000000;
+                for (size_t k = first; k < last; k++) {
+                    const TileTask& task = tasks[k];
+                    size_t channel = images[task.image].channels();
+                    if (task.tile == 0 && task.channel == 0) {
+                        writer.beginImage(image_ciphers[task.image]);
+                    }
+                    writer.appendSerialized(ciphers[k - first], norms[k - first]);
+                    if (task.tile * channel + task.channel + 1 == image_ciphers[task.image]) {
+                        size_t i = dirty[begin + task.image];
+                        writer.endImage(names[i]);
+                        manifest << hex << hashes[i] << dec << "\t" << names[i] << "\t" << image_paths[i] << "\n";
+                        if (is_new[i]) {
+                            stats.added++;
+                        }
+                        else {
+                            stats.updated++;
+                        }
+                    }
+                }
+            }
+        }
+        writer.close();
+        manifest.close();
+        if (!manifest) {
+            cerr << "Unable to write the manifest: " << manifest_path << endl;
+            remove_temp();
+            return false;
+        }
+    }
+    // 替换之前释放旧密文包的映射
+    old_pack.reset();
+    // 先替换密文包和索引，最后替换清单：清单过期只会导致下次多加密一些图像；
+    // 两次 rename 之间中断时新包与旧索引的代数不一致，CipherStore 和下次入库都不会使用它们
+    error_code ec;
+    rename(pack_path + ".tmp", pack_path, ec);
+    if (!ec) {
+        rename(pack_path + ".tmp.idx", index_path, ec);
+    }
+    if (!ec) {
+        rename(manifest_path + ".tmp", manifest_path, ec);
+    }
+    if (ec) {
+        cerr << "Unable to replace the cipher pack " << pack_path << ": " << ec.message() << endl;
+        remove_temp();
+        return false;
+    }
+    stats.write_time = static_cast<double>(getClockTime() - write_start) / 1000000 - stats.encrypt_time;
+    return true;
+}
+CipherStore::CipherStore(const CKKS& _cryptor, const string& _store_path, size_t _memory_budget)
+    : cryptor(_cryptor), store_path(_store_path), memory_budget(_memory_budget) {
+    reload();
+}
+void CipherStore::readDirectory() {
+    vector<string> dirs;
+    getSubDir(store_path, dirs);
+    sort(dirs.begin(), dirs.end());
+    entries = vector<Entry>(dirs.size());
+    for (size_t i = 0; i < dirs.size(); i++) {
+        entries[i].path = dirs[i];
+    }
+}
+void CipherStore::readPack() {
+    entries.clear();
+    parameter_header.clear();
+    preset_name.clear();
+    pack = make_unique<MappedFile>(store_path);
+    ifstream index(store_path + ".idx");
+    if (!pack->is_open() || !index.is_open()) {
+        cerr << "Error: can't open cipher pack " << store_path << endl;
+        return;
+    }
+    string line;
+    while (getline(index, line)) {
+        if (!line.empty() && line[0] == '#') {
+            if (line.compare(0, 13, "# generation ") == 0 && !packGenerationMatches(*pack, line.substr(13))) {
+                cerr << "Error: " << store_path << ".idx does not belong to cipher pack " << store_path << endl;
+                entries.clear();
+                return;
+            }
+            if (line.compare(0, 9, "# params ") == 0) {
+                parameter_header = line.substr(9);
+                if (parameter_header != cryptor.parameterHeader()) {
+                    cerr << "Error: cipher pack " << store_path << " was encrypted with parameters (" << parameter_header
+                        << "), current parameters are (" << cryptor.parameterHeader() << ")" << endl;
+                    entries.clear();
+                    return;
+                }
+            }
+            if (line.compare(0, 9, "# preset ") == 0) {
+                preset_name = line.substr(9);
+            }
+            continue;
+        }
+        PackIndexEntry parsed;
+        bool valid = parsePackIndexLine(line, parsed);
+        for (size_t i = 0; i < parsed.cipher_ranges.size(); i++) {
+            if (parsed.cipher_ranges[i].first + parsed.cipher_ranges[i].second > pack->size()
+                || parsed.norm_ranges[i].first + parsed.norm_ranges[i].second > pack->size()) {
+                valid = false;
+            }
+        }
+        if (valid) {
+            Entry entry;
+            entry.path = parsed.name;
+            entry.cipher_ranges = parsed.cipher_ranges;
+            entry.norm_ranges = parsed.norm_ranges;
+            entries.push_back(entry);
+        }
+        else {
+            cerr << "Error: broken index entry in " << store_path << ".idx" << endl;
+        }
+    }
+}
+void CipherStore::reload() {
+    lock_guard<mutex> lock(store_mutex);
+    lru.clear();
+    memory_usage = 0;
+    pack.reset();
+    if (is_regular_file(store_path)) {
+        readPack();
+    }
+    else {
+        readDirectory();
+    }
+    for (Entry& entry : entries) {
+        entry.lru_pos = lru.end();
+    }
+    // 预载入，直到用完内存预算，其余条目在访问时再载入
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (memory_budget != 0 && memory_usage >= memory_budget) {
+            break;
+        }
+        load(i);
+    }
+    evict(entries.size());
+}
+shared_ptr<const vector<Ciphertext>> CipherStore::get(size_t index) {
+    Entry& entry = entries[index];
+    vector<double> norms;
+    {
+        lock_guard<mutex> lock(store_mutex);
+        if (entry.ciphers) {
+            lru.splice(lru.begin(), lru, entry.lru_pos);
+            return entry.ciphers;
+        }
+        norms = entry.norms;
+    }
+    // 反序列化和范数计算在锁外进行，多个线程可以同时载入不同的候选；只有未命中缓存时记录 load 事件
+    auto ciphers = make_shared<vector<Ciphertext>>();
+    {
+        TraceSpan trace("load");
+        trace.arg("index", static_cast<double>(index));
+        deserialize(entry, *ciphers, norms);
+    }
+    lock_guard<mutex> lock(store_mutex);
+    if (entry.ciphers) {
+        // 其他线程已经载入了同一个条目
+        lru.splice(lru.begin(), lru, entry.lru_pos);
+    }
+    else {
+        install(index, ciphers, norms);
+        evict(index);
+    }
+    return entry.ciphers;
+}
+vector<double> CipherStore::getNorms(size_t index) {
+    lock_guard<mutex> lock(store_mutex);
+    return entries[index].norms;
+}
+void CipherStore::getNorms(size_t index, vector<double>& result) {
+    lock_guard<mutex> lock(store_mutex);
+    result.assign(entries[index].norms.begin(), entries[index].norms.end());
+}
+size_t CipherStore::getMemoryUsage() {
+    lock_guard<mutex> lock(store_mutex);
+    return memory_usage;
+}
+size_t CipherStore::getMemoryBudget() {
+    lock_guard<mutex> lock(store_mutex);
+    return memory_budget;
+}
+void CipherStore::setMemoryBudget(size_t _memory_budget) {
+    lock_guard<mutex> lock(store_mutex);
+    memory_budget = _memory_budget;
+    evict(entries.size());
+}
+size_t CipherStore::getLoadCount() {
+    lock_guard<mutex> lock(store_mutex);
+    return load_count;
+}
+void CipherStore::load(size_t index) {
+    TraceSpan trace("load");
+    trace.arg("index", static_cast<double>(index));
+    auto ciphers = make_shared<vector<Ciphertext>>();
+    vector<double> norms = entries[index].norms;
+    deserialize(entries[index], *ciphers, norms);
+    install(index, ciphers, norms);
+}
+// 只读取条目中载入后不再变化的路径和偏移，不需要持有 store_mutex
+void CipherStore::deserialize(const Entry& entry, vector<Ciphertext>& ciphers, vector<double>& norms) {
+    loadCiphers(entry, ciphers);
+    if (norms.size() != ciphers.size()) {
+        // 优先读取入库时保存的范数密文，旧的密文库则在这里同态计算一次
+        norms.clear();
+        for (size_t i = 0; i < ciphers.size(); i++) {
+            Ciphertext norm;
+            if (loadNorm(entry, i, norm)) {
+                norms.push_back(cryptor.decryptSelfDot(norm));
+            }
+            else {
+                norms.push_back(cryptor.selfDot(ciphers[i]));
+            }
+        }
+    }
+}
+void CipherStore::install(size_t index, shared_ptr<const vector<Ciphertext>> ciphers, const vector<double>& norms) {
+    Entry& entry = entries[index];
+    entry.bytes = 0;
+    for (const Ciphertext& cipher : *ciphers) {
+        entry.bytes += ciphertextBytes(cipher);
+    }
+    entry.norms = norms;
+    entry.ciphers = ciphers;
+    memory_usage += entry.bytes;
+    lru.push_front(index);
+    entry.lru_pos = lru.begin();
+    load_count++;
+}
+void CipherStore::loadCiphers(const Entry& entry, vector<Ciphertext>& ciphers) {
+    if (!pack) {
+        loadImageCiphers(cryptor, entry.path, ciphers);
+        return;
+    }
+    for (auto& range : entry.cipher_ranges) {
+        ciphers.emplace_back();
+        cryptor.loadCiphertext(pack->data() + range.first, range.second, ciphers.back());
+    }
+}
+bool CipherStore::loadNorm(const Entry& entry, size_t channel, Ciphertext& norm) {
+    if (pack) {
+        if (channel >= entry.norm_ranges.size() || entry.norm_ranges[channel].second == 0) {
+            return false;
+        }
+        cryptor.loadCiphertext(pack->data() + entry.norm_ranges[channel].first, entry.norm_ranges[channel].second, norm);
+        return true;
+    }
+    string norm_path = entry.path + "\\" + to_string(channel) + ".norm";
+    if (!exists(norm_path)) {
+        return false;
+    }
+    cryptor.loadCiphertext(norm_path, norm);
+    return true;
+}
+void CipherStore::evict(size_t keep) {
+    if (memory_budget == 0) {
+        return;
+    }
+    // 从表尾（最久未使用）开始淘汰，keep 为刚访问的条目，不淘汰
+    auto it = lru.end();
+    while (memory_usage > memory_budget && it != lru.begin()) {
+        --it;
+        if (*it == keep) {
+            continue;
+        }
+        Entry& entry = entries[*it];
+        entry.ciphers.reset();
+        memory_usage -= entry.bytes;
+        entry.bytes = 0;
+        entry.lru_pos = lru.end();
+        it = lru.erase(it);
+    }
+}
+long long getClockTime() {
+    // 获取当前高分辨率时间点
+    auto currentTimePoint = std::chrono::high_resolution_clock::now();
+
+    // 将当前时间点转换为时间戳（以纳秒为单位）
+    auto timestamp = std::chrono::time_point_cast<std::chrono::nanoseconds>(currentTimePoint).time_since_epoch().count();
+
+    // 输出时间戳
+    //std::cout << "High-resolution Timestamp: " << timestamp << " ns" << std::endl;
+    return timestamp;
+}
+uint64_t Histogram::percentile(double p) const {
+    uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(p / 100 * n)));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < bucket_count; b++) {
+        seen += buckets[b].load(memory_order_relaxed);
+        if (seen >= rank) {
+            return b == 0 ? 0 : (static_cast<uint64_t>(1) << b) - 1;
+        }
+    }
+    return (static_cast<uint64_t>(1) << (bucket_count - 1)) - 1;
+}
+void Histogram::reset() {
+    for (auto& bucket : buckets) {
+        bucket.store(0, memory_order_relaxed);
+    }
+    samples.store(0, memory_order_relaxed);
+    total.store(0, memory_order_relaxed);
+}
+const char* Metrics::name(MetricOp op) {
+    static const char* names[] = { "encode", "decode", "encrypt", "decrypt", "multiply", "multiply_plain", "relinearize", "rescale", "rotate", "mod_switch", "deserialize" };
+    return names[static_cast<size_t>(op)];
+}
+const char* Metrics::name(MetricCounter counter) {
+    static const char* names[] = { "bytes_loaded", "candidates", "queries" };
+    return names[static_cast<size_t>(counter)];
+}
+void Metrics::enable(bool metrics, bool trace) {
+    lock_guard<mutex> lock(trace_mutex);
+    if (trace && !trace_enabled) {
+        trace_origin = getClockTime();
+    }
+    metrics_enabled = metrics;
+    trace_enabled = trace;
+}
+// trace 中的线程编号，按线程第一次记录事件的顺序分配
+static size_t traceThreadId() {
+    static atomic<size_t> next_id(0);
+    thread_local size_t id = next_id++;
+    return id;
+}
+void Metrics::span(const string& name, long long start, long long end, const string& args) {
+    size_t thread_id = traceThreadId();
+    lock_guard<mutex> lock(trace_mutex);
+    if (events.size() >= max_trace_events) {
+        dropped_events++;
+        return;
+    }
+    events.push_back(TraceEvent{ name, start, end - start, thread_id, args });
+}
+void Metrics::reset() {
+    for (Histogram& histogram : ops) {
+        histogram.reset();
+    }
+    for (auto& counter : counters) {
+        counter.store(0, memory_order_relaxed);
+    }
+    candidates_per_query.reset();
+    lock_guard<mutex> lock(trace_mutex);
+    events.clear();
+    dropped_events = 0;
+    trace_origin = getClockTime();
+}
+void Metrics::report(ostream& out) const {
+    ios old_fmt(nullptr);
+    old_fmt.copyfmt(out);
+    out << fixed << setprecision(4);
+    out << "   / " << setw(16) << "op" << setw(12) << "count" << setw(14) << "total(ms)" << setw(12) << "mean(ms)"
+        << setw(12) << "p50(ms)" << setw(12) << "p99(ms)" << endl;
+    for (size_t i = 0; i < static_cast<size_t>(MetricOp::count); i++) {
+        const Histogram& histogram = ops[i];
+        if (histogram.count() == 0) {
+            continue;
+        }
+        out << "   | " << setw(16) << name(static_cast<MetricOp>(i)) << setw(12) << histogram.count()
+            << setw(14) << static_cast<double>(histogram.sum()) / 1000000
+            << setw(12) << static_cast<double>(histogram.sum()) / histogram.count() / 1000000
+            << setw(12) << static_cast<double>(histogram.percentile(50)) / 1000000
+            << setw(12) << static_cast<double>(histogram.percentile(99)) / 1000000 << endl;
+    }
+    for (size_t i = 0; i < static_cast<size_t>(MetricCounter::count); i++) {
+        out << "   | " << setw(16) << name(static_cast<MetricCounter>(i)) << setw(12) << counter(static_cast<MetricCounter>(i)) << endl;
+    }
+    if (candidates_per_query.count() != 0) {
+        out << "   | " << "candidates per query: mean " << static_cast<double>(candidates_per_query.sum()) / candidates_per_query.count()
+            << ", p99 <= " << candidates_per_query.percentile(99) << endl;
+    }
+    out << "   \\" << endl;
+    out.copyfmt(old_fmt);
+}
+bool Metrics::writeJson(const string& path) const {
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Unable to open the file for writing: " << path << endl;
+        return false;
+    }
+    out << setprecision(9);
+    out << "{\n  \"unit\": \"ms\",\n  \"ops\": [\n";
+    bool first = true;
+    for (size_t i = 0; i < static_cast<size_t>(MetricOp::count); i++) {
+        const Histogram& histogram = ops[i];
+        out << (first ? "" : ",\n") << "    { \"op\": \"" << name(static_cast<MetricOp>(i)) << "\", \"count\": " << histogram.count()
+            << ", \"total\": " << static_cast<double>(histogram.sum()) / 1000000
+            << ", \"p50\": " << static_cast<double>(histogram.percentile(50)) / 1000000
+            << ", \"p95\": " << static_cast<double>(histogram.percentile(95)) / 1000000
+            << ", \"p99\": " << static_cast<double>(histogram.percentile(99)) / 1000000 << " }";
+        first = false;
+    }
+    out << "\n  ],\n  \"counters\": {";
+    for (size_t i = 0; i < static_cast<size_t>(MetricCounter::count); i++) {
+        out << (i == 0 ? " " : ", ") << "\"" << name(static_cast<MetricCounter>(i)) << "\": " << counter(static_cast<MetricCounter>(i));
+    }
+    out << " },\n  \"candidates_per_query\": { \"count\": " << candidates_per_query.count() << ", \"sum\": " << candidates_per_query.sum()
+        << ", \"p50\": " << candidates_per_query.percentile(50) << ", \"p99\": " << candidates_per_query.percentile(99) << " }\n}\n";
+    return true;
+}
+// Chrome trace 的 JSON 格式，时间单位为 us，从 enable 或 reset 开始计时
+bool Metrics::writeTrace(const string& path) const {
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Unable to open the file for writing: " << path << endl;
+        return false;
+    }
+    lock_guard<mutex> lock(trace_mutex);
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& event = events[i];
+        out << "  {\"name\": \"" << event.name << "\", \"cat\": \"ckks\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << static_cast<double>(event.start - trace_origin) / 1000
+            << ", \"dur\": " << static_cast<double>(event.duration) / 1000
+            << ", \"args\": {" << event.args << "}}" << (i + 1 < events.size() ? "," : "") << "\n";
+    }
+    out << "], \"otherData\": {\"dropped_events\": " << dropped_events << "}}\n";
+    return true;
+}
+void search(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const string& image_dir, string& str, vector<Ciphertext>& result, double& count_time) {
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        str = "";
+        result = vector<Ciphertext>();
+        return;
+    }
+    vector<string> cipher_dir;
+    getSubDir(image_dir, cipher_dir);
+    for (auto& dir : cipher_dir) {
+        long long start = getClockTime();
+        double cos_s = cosineImageSimilarity(cryptor, ciphers, dir, result);
+        long long end = getClockTime();
+        /*ios old_fmt(nullptr);
+        old_fmt.copyfmt(cout);
+        cout << fixed << setprecision(10);
+        cout << cos_s << endl;
+        cout.copyfmt(old_fmt);*/
+        if (cos_s > 0.9999) {
+            str = dir;
+            count_time = static_cast<double>(end - start) / 1000000;
+            return;
+        }
+    }
+    str = "";
+    result = vector<Ciphertext>();
+}
+/*
+库内密文可能保存在较低的层级（CipherFormat::lowest_level），查询密文在 search 开始时一次性切换到库内密文的层级，
+之后每个候选的 dot 不再需要做层级对齐
+*/
+void alignQuery(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, vector<Ciphertext>& query) {
+    query = ciphers;
+    if (store.size() == 0) {
+        return;
+    }
+    shared_ptr<const vector<Ciphertext>> first = store.get(0);
+    // 分块的大图像保存在较高的层级（CKKS::imageParmsId），查询不能切换到比同样大小的候选更低的层级
+    const SEALContext& context = cryptor.getContext();
+    parms_id_type needed = cryptor.imageParmsId(ciphers.size());
+    for (size_t c = 0; c < query.size() && c < first->size(); c++) {
+        parms_id_type target = (*first)[c].parms_id();
+        if (needed != parms_id_zero && context.get_context_data(needed)->chain_index() > context.get_context_data(target)->chain_index()) {
+            target = needed;
+        }
+        cryptor.modSwitchTo(ciphers[c], target, query[c]);
+    }
+}
+void search(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, string& str, vector<Ciphertext>& result, double& count_time, size_t pixels) {
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        str = "";
+        result = vector<Ciphertext>();
+        return;
+    }
+    QueryMetrics query_metrics("search");
+    // 查询图像的平方范数每次 search 只计算一次；只对查询图像实际占用的槽位求和
+    size_t span = pixels == 0 ? 0 : nextPowerOfTwo(pixels);
+    vector<double> norms;
+    for (const Ciphertext& cipher : ciphers) {
+        norms.push_back(cryptor.selfDot(cipher));
+    }
+    vector<Ciphertext> query;
+    alignQuery(cryptor, ciphers, store, query);
+    vector<double> candidate_norms;
+    for (size_t i = 0; i < store.size(); i++) {
+        query_metrics.candidates++;
+        shared_ptr<const vector<Ciphertext>> candidates = store.get(i);
+        store.getNorms(i, candidate_norms);
+        long long start = getClockTime();
+        double cos_s = cosineImageSimilarity(cryptor, query, norms, *candidates, candidate_norms, span);
+        long long end = getClockTime();
+        if (cos_s > image_similarity_threshold) {
+            str = store.path(i);
+            result = *candidates;
+            count_time = static_cast<double>(end - start) / 1000000;
+            return;
+        }
+    }
+    str = "";
+    result = vector<Ciphertext>();
+}
+void searchParallel(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, string& str, vector<Ciphertext>& result, double& count_time, size_t num_threads, size_t pixels) {
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        str = "";
+        result = vector<Ciphertext>();
+        return;
+    }
+    QueryMetrics query_metrics("searchParallel");
+    if (num_threads == 0) {
+        num_threads = max<size_t>(1, thread::hardware_concurrency());
+    }
+    num_threads = min(num_threads, max<size_t>(1, store.size()));
+    size_t span = pixels == 0 ? 0 : nextPowerOfTwo(pixels);
+    vector<double> norms;
+    for (const Ciphertext& cipher : ciphers) {
+        norms.push_back(cryptor.selfDot(cipher));
+    }
+    vector<Ciphertext> query;
+    alignQuery(cryptor, ciphers, store, query);
+    str = "";
+    result = vector<Ciphertext>();
+
+    // 各线程从 next 处领取下一个候选，found 置位后其余线程不再领取新的候选
+    atomic<size_t> next(0);
+    atomic<bool> found(false);
+    mutex result_mutex;
+    auto work = [&]() {
+        CKKS::Worker worker(cryptor);
+        vector<double> candidate_norms;
+        while (!found) {
+            size_t i = next++;
+            if (i >= store.size()) {
+                break;
+            }
+            shared_ptr<const vector<Ciphertext>> candidates = store.get(i);
+            store.getNorms(i, candidate_norms);
+            long long start = getClockTime();
+            double cos_s = cosineImageSimilarity(worker, query, norms, *candidates, candidate_norms, span);
+            long long end = getClockTime();
+            if (cos_s > image_similarity_threshold) {
+                lock_guard<mutex> lock(result_mutex);
+                if (!found) {
+                    found = true;
+                    str = store.path(i);
+                    result = *candidates;
+                    count_time = static_cast<double>(end - start) / 1000000;
+                }
+            }
+        }
+    };
+    vector<thread> workers;
+    for (size_t t = 0; t < num_threads; t++) {
+        workers.emplace_back(work);
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+    // next 只在领取到候选后才会超过 store.size()，领取到的候选都已打分
+    query_metrics.candidates = min(next.load(), store.size());
+}
+void searchBatched(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t pixels, const vector<CipherBatch>& batches, string& str, vector<Ciphertext>& result, double& count_time) {
+    str = "";
+    result = vector<Ciphertext>();
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    QueryMetrics query_metrics("searchBatched");
+    size_t span = nextPowerOfTwo(pixels);
+    vector<double> norms;
+    vector<Ciphertext> replicated(ciphers.size());
+    {
+        TraceSpan trace("replicate");
+        for (size_t c = 0; c < ciphers.size(); c++) {
+            norms.push_back(cryptor.selfDot(ciphers[c]));
+            cryptor.replicate(ciphers[c], span, replicated[c]);
+        }
+    }
+    for (const CipherBatch& batch : batches) {
+        // 尺寸不同的批次中不可能有相同的图像
+        if (batch.span != span || batch.ciphers.size() != ciphers.size()) {
+            continue;
+        }
+        long long start = getClockTime();
+        size_t count = batch.paths.size();
+        vector<double> scores;
+        {
+            // 一批候选一次打分，trace 中每批一个 similarity 事件
+            TraceSpan trace("similarity");
+            trace.arg("candidates", static_cast<double>(count));
+            cryptor.dotBatch(replicated, batch.ciphers, span, count, scores);
+        }
+        query_metrics.candidates += count;
+        for (size_t k = 0; k < count; k++) {
+            double candidate_norm = 0;
+            for (size_t c = 0; c < ciphers.size(); c++) {
+                candidate_norm += batch.norms[c][k];
+            }
+            scores[k] /= sqrt(add_self(norms) * candidate_norm);
+        }
+        long long end = getClockTime();
+        for (size_t k = 0; k < count; k++) {
+            if (scores[k] > image_similarity_threshold) {
+                str = batch.paths[k];
+                TraceSpan trace("extract");
+                for (const Ciphertext& cipher : batch.ciphers) {
+                    Ciphertext temp;
+                    cryptor.extract(cipher, span, k, temp);
+                    result.push_back(temp);
+                }
+                count_time = static_cast<double>(end - start) / 1000000;
+                return;
+            }
+        }
+    }
+}
+// 堆顶为分数最低的元素
+static bool scoreGreater(const SearchMatch& a, const SearchMatch& b) {
+    return a.score > b.score;
+}
+bool TopK::accepts(double score) const {
+    // 范数为 0 的全黑图像得到 0/0 = NaN，NaN 不满足严格弱序，不能进入堆
+    if (k == 0 || isnan(score) || score < threshold) {
+        return false;
+    }
+    return heap.size() < k || score > heap.front().score;
+}
+void TopK::push(const string& path, double score) {
+    if (!accepts(score)) {
+        return;
+    }
+    if (heap.size() == k) {
+        pop_heap(heap.begin(), heap.end(), scoreGreater);
+        heap.pop_back();
+    }
+    heap.push_back({ path, score });
+    push_heap(heap.begin(), heap.end(), scoreGreater);
+}
+void TopK::merge(const TopK& other) {
+    for (const SearchMatch& match : other.heap) {
+        push(match.path, match.score);
+    }
+}
+vector<SearchMatch> TopK::sorted() const {
+    vector<SearchMatch> result = heap;
+    sort(result.begin(), result.end(), scoreGreater);
+    return result;
+}
+void rankSearch(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, size_t k, double threshold, RankResult& result, size_t num_threads, size_t pixels) {
+    result = RankResult();
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    // 单个查询即只有一个查询的 rankSearchMulti，两者共用同一套遍历、合并和计时
+    vector<RankResult> results;
+    rankSearchMulti(cryptor, { ciphers }, store, k, threshold, results, num_threads, { pixels });
+    result = move(results[0]);
+}
+/*
+多查询的排序检索：库只遍历一次，每个候选载入后立即与全部查询打分，载入和反序列化的开销由整批查询分摊。
+results[q] 对应 queries[q]，pixels 为空时对全部槽位求和；各结果的 load_time 为整批共享的载入耗时
+*/
+void rankSearchMulti(const CKKS& cryptor, const vector<vector<Ciphertext>>& queries, CipherStore& store, size_t k, double threshold, vector<RankResult>& results, size_t num_threads, const vector<size_t>& pixels) {
+    size_t count = queries.size();
+    results = vector<RankResult>(count);
+    if (count == 0) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    TraceSpan trace("rankSearchMulti");
+    trace.arg("queries", static_cast<double>(count));
+    long long begin = getClockTime();
+    if (num_threads == 0) {
+        num_threads = max<size_t>(1, thread::hardware_concurrency());
+    }
+    num_threads = min(num_threads, max<size_t>(1, store.size()));
+    vector<size_t> spans(count, 0);
+    vector<vector<double>> norms(count);
+    vector<vector<Ciphertext>> aligned(count);
+    for (size_t q = 0; q < count; q++) {
+        long long start = getClockTime();
+        if (q < pixels.size() && pixels[q] != 0) {
+            spans[q] = nextPowerOfTwo(pixels[q]);
+        }
+        for (const Ciphertext& cipher : queries[q]) {
+            norms[q].push_back(cryptor.selfDot(cipher));
+        }
+        alignQuery(cryptor, queries[q], store, aligned[q]);
+        results[q].timing.prepare_time = static_cast<double>(getClockTime() - start) / 1000000;
+    }
+
+    vector<TopK> tops(count, TopK(k, threshold));
+    double load_time = 0;
+    atomic<size_t> next(0);
+    mutex result_mutex;
+    auto work = [&]() {
+        CKKS::Worker worker(cryptor);
+        vector<TopK> local(count, TopK(k, threshold));
+        vector<RankTiming> timing(count);
+        vector<size_t> scored(count, 0);
+        double local_load_time = 0;
+        vector<double> candidate_norms;
+        for (size_t i = next++; i < store.size(); i = next++) {
+            long long start = getClockTime();
+            shared_ptr<const vector<Ciphertext>> candidates = store.get(i);
+            store.getNorms(i, candidate_norms);
+            local_load_time += static_cast<double>(getClockTime() - start) / 1000000;
+            // 交换循环顺序：候选在外层，查询在内层，候选密文在整批查询打分期间一直在缓存中
+            for (size_t q = 0; q < count; q++) {
+                if (candidates->size() != aligned[q].size()) {
+                    continue;
+                }
+                long long score_start = getClockTime();
+                double cos_s = cosineImageSimilarity(worker, aligned[q], norms[q], *candidates, candidate_norms, spans[q]);
+                long long scored_time = getClockTime();
+                if (local[q].accepts(cos_s)) {
+                    local[q].push(store.path(i), cos_s);
+                }
+                long long end = getClockTime();
+                timing[q].score_time += static_cast<double>(scored_time - score_start) / 1000000;
+                timing[q].rank_time += static_cast<double>(end - scored_time) / 1000000;
+                scored[q]++;
+            }
+        }
+        lock_guard<mutex> lock(result_mutex);
+        for (size_t q = 0; q < count; q++) {
+            long long start = getClockTime();
+            tops[q].merge(local[q]);
+            results[q].timing.score_time += timing[q].score_time;
+            results[q].timing.rank_time += timing[q].rank_time + static_cast<double>(getClockTime() - start) / 1000000;
+            results[q].scored += scored[q];
+        }
+        load_time += local_load_time;
+    };
+    vector<thread> workers;
+    for (size_t t = 0; t < num_threads; t++) {
+        workers.emplace_back(work);
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+    double total_time = static_cast<double>(getClockTime() - begin) / 1000000;
+    for (size_t q = 0; q < count; q++) {
+        results[q].matches = tops[q].sorted();
+        results[q].timing.load_time = load_time;
+        results[q].timing.total_time = total_time;
+        Metrics::instance().recordQuery(results[q].scored);
+    }
+}
+CandidateQueue::CandidateQueue(size_t _capacity) : capacity(max<size_t>(1, _capacity)) {}
+void CandidateQueue::push(CandidateItem item) {
+    unique_lock<mutex> lock(queue_mutex);
+    if (items.size() >= capacity) {
+        push_stalls++;
+        not_full.wait(lock, [&]() { return items.size() < capacity; });
+    }
+    items.push_back(move(item));
+    max_depth = max(max_depth, items.size());
+    not_empty.notify_one();
+}
+bool CandidateQueue::pop(CandidateItem& item) {
+    unique_lock<mutex> lock(queue_mutex);
+    if (items.empty() && !closed) {
+        pop_stalls++;
+        not_empty.wait(lock, [&]() { return !items.empty() || closed; });
+    }
+    if (items.empty()) {
+        return false;
+    }
+    item = move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+}
+void CandidateQueue::close() {
+    lock_guard<mutex> lock(queue_mutex);
+    closed = true;
+    not_empty.notify_all();
+}
+size_t CandidateQueue::getPushStalls() {
+    lock_guard<mutex> lock(queue_mutex);
+    return push_stalls;
+}
+size_t CandidateQueue::getPopStalls() {
+    lock_guard<mutex> lock(queue_mutex);
+    return pop_stalls;
+}
+size_t CandidateQueue::getMaxDepth() {
+    lock_guard<mutex> lock(queue_mutex);
+    return max_depth;
+}
+/*
+流水线排序检索：io_threads 个线程按顺序领取候选，载入并反序列化后放入容量为 queue_depth 的有界队列，
+eval_threads 个线程从队列中取出候选打分；载入与计算重叠进行，总耗时趋近 max(载入, 计算) 而不是两者之和。
+eval_threads 为 0 时使用硬件线程数减去 io_threads
+*/
+void rankPipelined(const CKKS& cryptor, const vector<Ciphertext>& ciphers, CipherStore& store, size_t k, double threshold, RankResult& result, PipelineStats& stats, size_t io_threads, size_t eval_threads, size_t queue_depth, size_t pixels) {
+    result = RankResult();
+    stats = PipelineStats();
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    QueryMetrics query_metrics("rankPipelined");
+    long long begin = getClockTime();
+    io_threads = max<size_t>(1, io_threads);
+    if (eval_threads == 0) {
+        size_t hardware = thread::hardware_concurrency();
+        eval_threads = hardware > io_threads ? hardware - io_threads : 1;
+    }
+    size_t span = pixels == 0 ? 0 : nextPowerOfTwo(pixels);
+    vector<double> norms;
+    for (const Ciphertext& cipher : ciphers) {
+        norms.push_back(cryptor.selfDot(cipher));
+    }
+    vector<Ciphertext> query;
+    alignQuery(cryptor, ciphers, store, query);
+    result.timing.prepare_time = static_cast<double>(getClockTime() - begin) / 1000000;
+
+    CandidateQueue queue(queue_depth);
+    TopK top(k, threshold);
+    atomic<size_t> next(0);
+    atomic<size_t> producers(io_threads);
+    mutex result_mutex;
+    auto load = [&]() {
+        double load_time = 0;
+        for (size_t i = next++; i < store.size(); i = next++) {
+            long long start = getClockTime();
+            CandidateItem item;
+            item.index = i;
+            item.ciphers = store.get(i);
+            item.norms = store.getNorms(i);
+            load_time += static_cast<double>(getClockTime() - start) / 1000000;
+            queue.push(move(item));
+        }
+        // 最后一个退出的 I/O 线程关闭队列
+        if (--producers == 0) {
+            queue.close();
+        }
+        lock_guard<mutex> lock(result_mutex);
+        result.timing.load_time += load_time;
+    };
+    auto score = [&]() {
+        CKKS::Worker worker(cryptor);
+        TopK local(k, threshold);
+        RankTiming timing;
+        size_t scored = 0;
+        CandidateItem item;
+        while (queue.pop(item)) {
+            if (item.ciphers->size() != query.size()) {
+                continue;
+            }
+            long long start = getClockTime();
+            double cos_s = cosineImageSimilarity(worker, query, norms, *item.ciphers, item.norms, span);
+            long long scored_time = getClockTime();
+            if (local.accepts(cos_s)) {
+                local.push(store.path(item.index), cos_s);
+            }
+            timing.score_time += static_cast<double>(scored_time - start) / 1000000;
+            timing.rank_time += static_cast<double>(getClockTime() - scored_time) / 1000000;
+            scored++;
+        }
+        lock_guard<mutex> lock(result_mutex);
+        top.merge(local);
+        result.timing.score_time += timing.score_time;
+        result.timing.rank_time += timing.rank_time;
+        result.scored += scored;
+    };
+    vector<thread> workers;
+    for (size_t t = 0; t < io_threads; t++) {
+        workers.emplace_back(load);
+    }
+    for (size_t t = 0; t < eval_threads; t++) {
+        workers.emplace_back(score);
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+    result.matches = top.sorted();
+    result.timing.total_time = static_cast<double>(getClockTime() - begin) / 1000000;
+    stats.queue_depth = max<size_t>(1, queue_depth);
+    stats.max_depth = queue.getMaxDepth();
+    stats.io_stalls = queue.getPushStalls();
+    stats.eval_stalls = queue.getPopStalls();
+    query_metrics.candidates = result.scored;
+}
+/*
+批量打分的排序检索：每批候选一次乘法、一次解密得到整批的相似度，再逐个放入堆中，
+排序的额外开销只有每个候选一次堆比较
+*/
+void rankBatched(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t pixels, const vector<CipherBatch>& batches, size_t k, double threshold, RankResult& result) {
+    result = RankResult();
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    QueryMetrics query_metrics("rankBatched");
+    long long begin = getClockTime();
+    size_t span = nextPowerOfTwo(pixels);
+    double norm = 0;
+    vector<Ciphertext> replicated(ciphers.size());
+    {
+        TraceSpan trace("replicate");
+        for (size_t c = 0; c < ciphers.size(); c++) {
+            norm += cryptor.selfDot(ciphers[c]);
+            cryptor.replicate(ciphers[c], span, replicated[c]);
+        }
+    }
+    result.timing.prepare_time = static_cast<double>(getClockTime() - begin) / 1000000;
+
+    TopK top(k, threshold);
+    for (const CipherBatch& batch : batches) {
+        if (batch.span != span || batch.ciphers.size() != ciphers.size()) {
+            continue;
+        }
+        long long start = getClockTime();
+        size_t count = batch.paths.size();
+        vector<double> scores;
+        {
+            TraceSpan trace("similarity");
+            trace.arg("candidates", static_cast<double>(count));
+            cryptor.dotBatch(replicated, batch.ciphers, span, count, scores);
+        }
+        long long scored_time = getClockTime();
+        for (size_t j = 0; j < count; j++) {
+            double candidate_norm = 0;
+            for (size_t c = 0; c < ciphers.size(); c++) {
+                candidate_norm += batch.norms[c][j];
+            }
+            double cos_s = scores[j] / sqrt(norm * candidate_norm);
+            if (top.accepts(cos_s)) {
+                top.push(batch.paths[j], cos_s);
+            }
+        }
+        long long end = getClockTime();
+        result.timing.score_time += static_cast<double>(scored_time - start) / 1000000;
+        result.timing.rank_time += static_cast<double>(end - scored_time) / 1000000;
+        result.scored += count;
+    }
+    result.matches = top.sorted();
+    result.timing.total_time = static_cast<double>(getClockTime() - begin) / 1000000;
+    query_metrics.candidates = result.scored;
+}
+void buildPlainDatabase(const CKKS& cryptor, const vector<string>& image_paths, PlainDatabase& database) {
+    for (const string& path : image_paths) {
+        vector<vector<double>> image;
+        getImageVector(path, image, cryptor.getSlot());
+        if (image.empty()) {
+            continue;
+        }
+        vector<Plaintext> plains(image.size());
+        double norm = 0;
+        for (size_t c = 0; c < image.size(); c++) {
+            cryptor.encodePlain(image[c], plains[c]);
+            norm += dot(image[c], image[c]);
+        }
+        database.paths.push_back(path);
+        database.plains.push_back(plains);
+        database.norms.push_back(norm);
+    }
+}
+/*
+明文库保存在 dir 下：index.txt 每行为 "平方范数 图像路径"，第 k 幅图像的各通道保存为 dir\<k>\<channel>.dat
+*/
+void savePlainDatabase(const CKKS& cryptor, const PlainDatabase& database, const string& dir) {
+    create_directories(dir);
+    ofstream index(dir + "\\index.txt");
+    index << setprecision(17);
+    for (size_t k = 0; k < database.paths.size(); k++) {
+        index << database.norms[k] << " " << database.paths[k] << "\n";
+        string image_dir = dir + "\\" + to_string(k);
+        create_directory(image_dir);
+        for (size_t c = 0; c < database.plains[k].size(); c++) {
+            cryptor.savePlaintext(image_dir + "\\" + to_string(c) + ".dat", database.plains[k][c]);
+        }
+    }
+}
+void loadPlainDatabase(const CKKS& cryptor, const string& dir, PlainDatabase& database) {
+    ifstream index(dir + "\\index.txt");
+    if (!index.is_open()) {
+        cerr << "Error: can't open plaintext database index in " << dir << endl;
+        return;
+    }
+    string line;
+    for (size_t k = 0; getline(index, line); k++) {
+        istringstream entry(line);
+        double norm;
+        string path;
+        if (!(entry >> norm) || !getline(entry >> ws, path)) {
+            cerr << "Error: broken plaintext database index in " << dir << endl;
+            return;
+        }
+        string image_dir = dir + "\\" + to_string(k);
+        vector<Plaintext> plains;
+        for (int c = 0; ; c++) {
+            string plain_path = image_dir + "\\" + to_string(c) + ".dat";
+            if (!exists(plain_path)) {
+                break;
+            }
+            plains.emplace_back();
+            cryptor.loadPlaintext(plain_path, plains.back());
+        }
+        database.paths.push_back(path);
+        database.plains.push_back(plains);
+        database.norms.push_back(norm);
+    }
+}
+void searchPlain(const CKKS& cryptor, const vector<Ciphertext>& ciphers, const PlainDatabase& database, string& str, vector<Plaintext>& result, double& count_time, size_t pixels) {
+    str = "";
+    result = vector<Plaintext>();
+    if (ciphers.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return;
+    }
+    QueryMetrics query_metrics("searchPlain");
+    size_t span = pixels == 0 ? 0 : nextPowerOfTwo(pixels);
+    double norm = 0;
+    for (const Ciphertext& cipher : ciphers) {
+        norm += cryptor.selfDot(cipher);
+    }
+    // 查询密文一次性切换到明文库的层级，之后每个候选都只做 multiply_plain
+    vector<Ciphertext> query = ciphers;
+    if (!database.plains.empty()) {
+        for (size_t c = 0; c < query.size() && c < database.plains[0].size(); c++) {
+            cryptor.modSwitchTo(ciphers[c], database.plains[0][c].parms_id(), query[c]);
+        }
+    }
+    for (size_t k = 0; k < database.paths.size(); k++) {
+        if (database.plains[k].size() != ciphers.size()) {
+            continue;
+        }
+        query_metrics.candidates++;
+        long long start = getClockTime();
+        double cos_s = cryptor.imageSimilarity(query, database.plains[k], norm, database.norms[k], span);
+        long long end = getClockTime();
+        if (cos_s > image_similarity_threshold) {
+            str = database.paths[k];
+            result = database.plains[k];
+            count_time = static_cast<double>(end - start) / 1000000;
+            return;
+        }
+    }
+}
+CKKS::Circuit::Node CKKS::Circuit::input(const Ciphertext& cipher) {
+    // 同一个密文重复 input 不是被去重的计算，不计入 reused
+    auto it = inputs.find(&cipher);
+    if (it != inputs.end()) {
+        return it->second;
+    }
+    exprs.push_back(Expr{ Op::input, 0, 0, 0, &cipher });
+    inputs[&cipher] = exprs.size() - 1;
+    return exprs.size() - 1;
+}
+// 相同的 (操作, 操作数, 步长) 只保留一个节点，add 和 mul 满足交换律，操作数按编号排序后再查找
+CKKS::Circuit::Node CKKS::Circuit::intern(const Expr& expr) {
+    Node lhs = expr.lhs, rhs = expr.rhs;
+    if (expr.op != Op::rotate && lhs > rhs) {
+        swap(lhs, rhs);
+    }
+    auto key = make_tuple(static_cast<int>(expr.op), lhs, rhs, expr.step);
+    auto it = interned.find(key);
+    if (it != interned.end()) {
+        stats.reused++;
+        return it->second;
+    }
+    exprs.push_back(Expr{ expr.op, lhs, rhs, expr.step, nullptr });
+    interned[key] = exprs.size() - 1;
+    return exprs.size() - 1;
+}
+CKKS::Circuit::Node CKKS::Circuit::add(Node a, Node b) {
+    return intern(Expr{ Op::add, a, b, 0, nullptr });
+}
+CKKS::Circuit::Node CKKS::Circuit::mul(Node a, Node b) {
+    return intern(Expr{ Op::mul, a, b, 0, nullptr });
+}
+CKKS::Circuit::Node CKKS::Circuit::rotate(Node a, int step) {
+    if (step == 0) {
+        return a;
+    }
+    return intern(Expr{ Op::rotate, a, a, step, nullptr });
+}
+CKKS::Circuit::Node CKKS::Circuit::sum(Node a, size_t span) {
+    span = span == 0 ? owner.slot_count : min(span, owner.slot_count);
+    for (size_t i = 1; i < span; i <<= 1) {
+        a = add(a, rotate(a, static_cast<int>(i)));
+    }
+    return a;
+}
+// 与 SEAL 检查 add 操作数尺度的方式相同（相对误差在一个 ulp 以内）
+static bool sameScale(double a, double b) {
+    return fabs(a - b) < numeric_limits<double>::epsilon() * max(max(fabs(a), fabs(b)), 1.0);
+}
+// rescale 后的尺度：与 rescale_to_next 相同，除以 raw 所在层级的最后一个素数
+double CKKS::Circuit::finalScale(Node node) const {
+    if (!pending[node]) {
+        return scales[node];
+    }
+    auto context_data = owner.context.get_context_data(parms_ids[levels[node]]);
+    return scales[node] / static_cast<double>(context_data->parms().coeff_modulus().back().value());
+}
+/*
+按节点编号（即拓扑序）推算每个节点的层级、尺度和是否待 rescale：
+mul 与 rotate 的操作数必须已重线性化并 rescale；add 的两个操作数都待 rescale 时直接相加，推迟到结果被使用时只做一次，
+只有一方待 rescale 时先对它 rescale；操作数层级不一致时都切换到较低的层级。
+add 的两个操作数尺度必须相同：两个乘积在不同层级 rescale 后尺度相差 q_i / q_j，相加会引入未计入的误差，此时规划失败
+*/
+bool CKKS::Circuit::plan(const vector<Node>& outputs) {
+    size_t count = exprs.size();
+    levels.assign(count, 0);
+    scales.assign(count, 0);
+    pending.assign(count, 0);
+    needed.assign(count, 0);
+    uses.assign(count, 0);
+    for (Node output : outputs) {
+        if (output >= count) {
+            cerr << "Error: circuit output " << output << " does not exist" << endl;
+            return false;
+        }
+        needed[output] = 1;
+        uses[output]++;
+    }
+    for (size_t i = count; i-- > 0;) {
+        if (needed[i] && exprs[i].op != Op::input) {
+            needed[exprs[i].lhs] = 1;
+            uses[exprs[i].lhs]++;
+            if (exprs[i].op != Op::rotate) {
+                needed[exprs[i].rhs] = 1;
+                uses[exprs[i].rhs]++;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!needed[i]) {
+            continue;
+        }
+        const Expr& expr = exprs[i];
+        if (expr.op == Op::input) {
+            levels[i] = owner.context.get_context_data(expr.cipher->parms_id())->chain_index();
+            scales[i] = expr.cipher->scale();
+            continue;
+        }
+        // 需要 rescale 的操作数不能已在最低层级
+        for (Node operand : { expr.lhs, expr.rhs }) {
+            bool final = expr.op != Op::add || !pending[expr.lhs] || !pending[expr.rhs];
+            if (final && pending[operand] && levels[operand] == 0) {
+                cerr << "Error: circuit node " << operand << " needs a rescale at the lowest level" << endl;
+                return false;
+            }
+        }
+        if (expr.op == Op::rotate) {
+            levels[i] = finalLevel(expr.lhs);
+            scales[i] = finalScale(expr.lhs);
+        }
+        else if (expr.op == Op::mul) {
+            levels[i] = min(finalLevel(expr.lhs), finalLevel(expr.rhs));
+            scales[i] = finalScale(expr.lhs) * finalScale(expr.rhs);
+            pending[i] = 1;
+        }
+        else {
+            // 两个操作数都待 rescale 时相加的是 raw（切换层级不改变尺度），否则相加的是 rescale 后的值
+            bool both_pending = pending[expr.lhs] && pending[expr.rhs];
+            double lhs_scale = both_pending ? scales[expr.lhs] : finalScale(expr.lhs);
+            double rhs_scale = both_pending ? scales[expr.rhs] : finalScale(expr.rhs);
+            if (!sameScale(lhs_scale, rhs_scale)) {
+                cerr << "Error: circuit node " << i << " adds operands with different scales (" << lhs_scale << " and " << rhs_scale
+                    << "), they must be rescaled at the same level" << endl;
+                return false;
+            }
+            levels[i] = both_pending ? min(levels[expr.lhs], levels[expr.rhs]) : min(finalLevel(expr.lhs), finalLevel(expr.rhs));
+            scales[i] = lhs_scale;
+            pending[i] = both_pending;
+        }
+    }
+    for (Node output : outputs) {
+        if (pending[output] && levels[output] == 0) {
+            cerr << "Error: circuit output " << output << " needs a rescale at the lowest level" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+// final 为 true 时返回重线性化并 rescale 后的值，同一个节点只做一次
+const Ciphertext& CKKS::Circuit::base(Node node, bool final) {
+    const Expr& expr = exprs[node];
+    const Ciphertext& raw = expr.op == Op::input ? *expr.cipher : values[node].raw;
+    if (!final || !pending[node]) {
+        return raw;
+    }
+    Value& value = values[node];
+    if (!value.has_final) {
+        value.final = raw;
+        if (value.final.size() > 2) {
+            MetricTimer timer(MetricOp::relinearize);
+            owner.evaluator->relinearize_inplace(value.final, owner.relinKeys());
+            stats.relinearizations++;
+        }
+        {
+            MetricTimer timer(MetricOp::rescale);
+            owner.evaluator->rescale_to_next_inplace(value.final);
+            stats.rescales++;
+        }
+        value.has_final = true;
+    }
+    return value.final;
+}
+// 取节点在 level 层级的值，切换层级的结果按 (节点, final, 层级) 缓存
+const Ciphertext& CKKS::Circuit::fetch(Node node, bool final, size_t level) {
+    const Ciphertext& cipher = base(node, final);
+    size_t current = final ? finalLevel(node) : levels[node];
+    if (current == level) {
+        return cipher;
+    }
+    map<size_t, Ciphertext>& switched = values[node].switched[final && pending[node] ? 1 : 0];
+    auto it = switched.find(level);
+    if (it == switched.end()) {
+        MetricTimer timer(MetricOp::mod_switch);
+        it = switched.emplace(level, Ciphertext()).first;
+        owner.evaluator->mod_switch_to(cipher, parms_ids[level], it->second);
+        stats.mod_switches++;
+    }
+    return it->second;
+}
+void CKKS::Circuit::execute(Node node) {
+    const Expr& expr = exprs[node];
+    Ciphertext& result = values[node].raw;
+    size_t level = levels[node];
+    if (expr.op == Op::rotate) {
+        MetricTimer timer(MetricOp::rotate);
+        // 默认密钥只有 1, 2, 4, ... 的正步长，其余步长由 SEAL 分解为 ±2^i 的组合，需要 batchGaloisKeys
+        const GaloisKeys& keys = owner.coversSteps({ expr.step }) ? owner.galoisKeys() : owner.batchGaloisKeys();
+        owner.evaluator->rotate_vector(fetch(expr.lhs, true, level), expr.step, keys, result);
+        stats.rotations++;
+    }
+    else if (expr.op == Op::mul) {
+        const Ciphertext& lhs = fetch(expr.lhs, true, level);
+        const Ciphertext& rhs = fetch(expr.rhs, true, level);
+        MetricTimer timer(MetricOp::multiply);
+        if (expr.lhs == expr.rhs) {
+            owner.evaluator->square(lhs, result);
+        }
+        else {
+            owner.evaluator->multiply(lhs, rhs, result);
+        }
+        stats.multiplies++;
+    }
+    else {
+        // 两个操作数都待 rescale 时相加的是尺度为平方的乘积，否则相加的是 rescale 后的值
+        bool final = !pending[node];
+        // plan 已确认两个操作数的尺度相同
+        owner.evaluator->add(fetch(expr.lhs, final, level), fetch(expr.rhs, final, level), result);
+    }
+    stats.nodes++;
+}
+bool CKKS::Circuit::run(const vector<Node>& outputs, vector<Ciphertext>& results) {
+    results.clear();
+    size_t reused = stats.reused;
+    stats = CircuitStats();
+    stats.reused = reused;
+    // plan 推算 rescale 后的尺度时需要各层级的参数
+    parms_ids.clear();
+    for (auto context_data = owner.context.first_context_data(); context_data; context_data = context_data->next_context_data()) {
+        if (parms_ids.size() <= context_data->chain_index()) {
+            parms_ids.resize(context_data->chain_index() + 1);
+        }
+        parms_ids[context_data->chain_index()] = context_data->parms_id();
+    }
+    if (!plan(outputs)) {
+        return false;
+    }
+    values.assign(exprs.size(), Value());
+    for (size_t i = 0; i < exprs.size(); i++) {
+        if (!needed[i]) {
+            continue;
+        }
+        if (exprs[i].op != Op::input) {
+            execute(i);
+            // 操作数不再被使用时立即释放其中间结果
+            if (--uses[exprs[i].lhs] == 0) {
+                values[exprs[i].lhs] = Value();
+            }
+            if (exprs[i].op != Op::rotate && --uses[exprs[i].rhs] == 0) {
+                values[exprs[i].rhs] = Value();
+            }
+        }
+    }
+    for (Node output : outputs) {
+        results.push_back(fetch(output, true, finalLevel(output)));
+    }
+    values = vector<Value>();
+    return true;
+}
+bool circuitSimilarity(const CKKS& cryptor, const vector<Ciphertext>& query, const vector<vector<Ciphertext>>& candidates, vector<double>& result, CircuitStats& stats, size_t span) {
+    result.assign(candidates.size(), 0);
+    if (query.empty()) {
+        cerr << "Error: input is empty" << endl;
+        return false;
+    }
+    CKKS::Circuit circuit(cryptor);
+    // 各通道乘积在电路中先累加，再对整幅图像做一次旋转求和
+    auto imageDot = [&](const vector<Ciphertext>& ciphers_1, const vector<Ciphertext>& ciphers_2) {
+        CKKS::Circuit::Node product = circuit.mul(circuit.input(ciphers_1[0]), circuit.input(ciphers_2[0]));
+        for (size_t c = 1; c < ciphers_1.size(); c++) {
+            product = circuit.add(product, circuit.mul(circuit.input(ciphers_1[c]), circuit.input(ciphers_2[c])));
+        }
+        return circuit.sum(product, span);
+    };
+    vector<CKKS::Circuit::Node> outputs = { imageDot(query, query) };
+    vector<size_t> scored;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (candidates[i].size() != query.size()) {
+            continue;
+        }
+        outputs.push_back(imageDot(query, candidates[i]));
+        outputs.push_back(imageDot(candidates[i], candidates[i]));
+        scored.push_back(i);
+    }
+    vector<Ciphertext> values;
+    bool ok = circuit.run(outputs, values);
+    stats = circuit.getStats();
+    if (!ok) {
+        return false;
+    }
+    vector<double> decrypted;
+    cryptor.decrypt(values[0], decrypted);
+    double query_norm = decrypted[0];
+    for (size_t k = 0; k < scored.size(); k++) {
+        cryptor.decrypt(values[1 + 2 * k], decrypted);
+        double inner = decrypted[0];
+        cryptor.decrypt(values[2 + 2 * k], decrypted);
+        result[scored[k]] = inner / sqrt(query_norm * decrypted[0]);
+    }
+    return true;
+}
+void evaluate(const CKKS& cryptor, const Ciphertext& cipher, double& add_time, double& mul_time, double& dot_time) {
+    Ciphertext result;
+    vector<double> add_times;
+    vector<double> mul_times;
+    vector<double> dot_times;
+    for (int i = 0; i < 1000; i++) {
+        long long time_0 = getClockTime();
+        for (int j = 0; j < 1000; j++) {
+            cryptor.add(cipher, cipher, result);
+        }
+        long long time_1 = getClockTime();
+        cryptor.mul_vector(cipher, cipher, result);
+        long long time_2 = getClockTime();
+        cryptor.dot(cipher, cipher, result);
+        long long time_3 = getClockTime();
+        // 1000 次加法的总耗时换算为单次加法的 ms
+        double add = static_cast<double>(time_1 - time_0) / 1000000 / 1000;
+        double mul = static_cast<double>(time_2 - time_1) / 1000000;
+        double dot = static_cast<double>(time_3 - time_2) / 1000000;
+        add_times.push_back(add);
+        mul_times.push_back(mul);
+        dot_times.push_back(dot);
+    }
+    add_time = add_self(add_times) / add_times.size();
+    mul_time = add_self(mul_times) / mul_times.size();
+    dot_time = add_self(dot_times) / dot_times.size();
+}
+// 槽位求和在给定 span 下的平均耗时（ms）
+void evaluateSumSlots(const CKKS& cryptor, const Ciphertext& cipher, size_t span, double& sum_time) {
+    vector<double> sum_times;
+    for (int i = 0; i < 100; i++) {
+        Ciphertext result = cipher;
+        long long start = getClockTime();
+        cryptor.sumSlots(result, span);
+        sum_times.push_back(static_cast<double>(getClockTime() - start) / 1000000);
+    }
+    sum_time = add_self(sum_times) / sum_times.size();
+}
+void evaluateStorage(const CKKS& cryptor, const vector<double>& input, vector<StorageStats>& result) {
+    vector<pair<string, CipherFormat>> formats = {
+        { "public/none", { false, compr_mode_type::none } },
+        { "public/zlib", { false, compr_mode_type::zlib } },
+        { "public/zstd", { false, compr_mode_type::zstd } },
+        { "seeded/none", { true, compr_mode_type::none } },
+        { "seeded/zlib", { true, compr_mode_type::zlib } },
+        { "seeded/zstd", { true, compr_mode_type::zstd } },
+        { "seeded/zstd/lowest", { true, compr_mode_type::zstd, true } },
+    };
+    for (auto& format : formats) {
+        StorageStats stats;
+        stats.mode = format.first;
+        vector<double> save_times;
+        vector<double> load_times;
+        for (int i = 0; i < 100; i++) {
+            stringstream buffer;
+            long long time_0 = getClockTime();
+            stats.bytes = cryptor.encryptTo(input, buffer, format.second);
+            long long time_1 = getClockTime();
+            string bytes = buffer.str();
+            Ciphertext cipher;
+            long long time_2 = getClockTime();
+            cryptor.loadCiphertext(reinterpret_cast<const seal_byte*>(bytes.data()), bytes.size(), cipher);
+            long long time_3 = getClockTime();
+            save_times.push_back(static_cast<double>(time_1 - time_0) / 1000000);
+            load_times.push_back(static_cast<double>(time_3 - time_2) / 1000000);
+        }
+        stats.save_time = add_self(save_times) / save_times.size();
+        stats.load_time = add_self(load_times) / load_times.size();
+        stats.load_throughput = stats.bytes / (stats.load_time / 1000) / (1024 * 1024);
+        result.push_back(stats);
+    }
+}
+/*
+多个线程共享同一个 CKKS 和同一个输入密文并发计算 dot，检查输入密文未被修改（parms_id 不变），
+且每个线程解密得到的结果与单线程结果一致
+*/
+bool verifyConcurrentDot(const CKKS& cryptor, const Ciphertext& cipher, size_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = max<size_t>(2, thread::hardware_concurrency());
+    }
+    Ciphertext lower = cipher;
+    if (cryptor.getContext().get_context_data(cipher.parms_id())->chain_index() >= 2) {
+        cryptor.mul_vector(cipher, cipher, lower);  // 层级比 cipher 低一层，触发层级对齐；乘法深度不够时（如 N4096）不对齐
+    }
+    parms_id_type cipher_id = cipher.parms_id();
+    parms_id_type lower_id = lower.parms_id();
+
+    Ciphertext expected_cipher;
+    vector<double> expected;
+    cryptor.dot(cipher, lower, expected_cipher);
+    cryptor.decrypt(expected_cipher, expected);
+
+    atomic<bool> ok(true);
+    vector<thread> workers;
+    for (size_t t = 0; t < num_threads; t++) {
+        workers.emplace_back([&]() {
+            for (int i = 0; i < 10; i++) {
+                Ciphertext result;
+                vector<double> vec;
+                cryptor.dot(cipher, lower, result);
+                cryptor.decrypt(result, vec);
+                if (abs(vec[0] - expected[0]) > 1e-3 * max(1.0, abs(expected[0]))) {
+                    ok = false;
+                }
+            }
+        });
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+    return ok && cipher.parms_id() == cipher_id && lower.parms_id() == lower_id;
+}
+bool verifyTiledDot(const CKKS& cryptor, const string& work_dir, int rows, int cols, const CipherFormat& format) {
+    Mat image(rows, cols, CV_8UC3);
+    randu(image, Scalar::all(0), Scalar::all(256));
+    string image_path = work_dir + "\\tiled_check.png";
+    string pack_path = work_dir + "\\tiled_check.pack";
+    if (!imwrite(image_path, image)) {
+        cerr << "Unable to write the test image: " << image_path << endl;
+        return false;
+    }
+    // 明文下的期望值：各块各通道的 dot() 之和
+    double expected = 0;
+    forEachImageTile(image, cryptor.getSlot(), [&](size_t tile, size_t channel, const vector<double>& pixels) {
+        expected += dot(pixels, pixels);
+    });
+    bool ok = false;
+    IngestStats stats;
+    if (ingestImages(cryptor, { image_path }, pack_path, work_dir, format, stats)) {
+        CipherStore store(cryptor, pack_path);
+        vector<Ciphertext> query, aligned;
+        if (store.size() == 1 && cryptor.enc_image_tiled(image, query)) {
+            alignQuery(cryptor, query, store, aligned);
+            Ciphertext product;
+            vector<double> values;
+            cryptor.dotImage(aligned, *store.get(0), product);
+            cryptor.decrypt(product, values);
+            double norm = add_self(store.getNorms(0));
+            ok = abs(values[0] - expected) <= 1e-3 * expected && abs(norm - expected) <= 1e-3 * expected;
+            if (!ok) {
+                cerr << "Error: tiled dot of a " << rows << "x" << cols << " image is " << values[0] << " (norm " << norm
+                    << "), plaintext dot is " << expected << endl;
+            }
+        }
+    }
+    error_code ignored;
+    remove(image_path, ignored);
+    remove(pack_path, ignored);
+    remove(pack_path + ".idx", ignored);
+    remove(pack_path + ".manifest", ignored);
+    return ok;
+}
+bool verifyBatchedScores(const CKKS& cryptor, const string& work_dir, size_t count, int rows, int cols) {
+    vector<string> paths;
+    for (size_t i = 0; i < count; i++) {
+        Mat image(rows, cols, CV_8UC3);
+        randu(image, Scalar::all(0), Scalar::all(256));
+        paths.push_back(work_dir + "\\batch_check_" + to_string(i) + ".png");
+        if (!imwrite(paths.back(), image)) {
+            cerr << "Unable to write the test image: " << paths.back() << endl;
+            paths.pop_back();
+            break;
+        }
+    }
+    bool ok = paths.size() == count;
+    vector<CipherBatch> batches;
+    if (ok) {
+        buildBatches(cryptor, paths, batches);
+        ok = !batches.empty();
+    }
+    // 逐个加密的候选作为参照
+    vector<vector<Ciphertext>> candidates(paths.size());
+    vector<double> candidate_norms(paths.size(), 0);
+    for (size_t i = 0; ok && i < paths.size(); i++) {
+        cryptor.enc_image(paths[i], candidates[i]);
+        for (const Ciphertext& cipher : candidates[i]) {
+            candidate_norms[i] += cryptor.selfDot(cipher);
+        }
+        ok = !candidates[i].empty();
+    }
+    size_t pixels = static_cast<size_t>(rows) * cols;
+    size_t span = nextPowerOfTwo(pixels);
+    for (size_t q = 0; ok && q < paths.size(); q++) {
+        // 阈值低于任何余弦值，所有候选都进入结果
+        RankResult ranked;
+        rankBatched(cryptor, candidates[q], pixels, batches, count, -2.0, ranked);
+        ok = ranked.matches.size() == count;
+        for (const SearchMatch& match : ranked.matches) {
+            size_t i = find(paths.begin(), paths.end(), match.path) - paths.begin();
+            double expected = i < paths.size() ? cryptor.imageSimilarity(candidates[q], candidates[i], candidate_norms[q], candidate_norms[i], span) : 0;
+            if (i >= paths.size() || abs(match.score - expected) > 1e-4) {
+                cerr << "Error: batched score of " << paths[q] << " against " << match.path << " is " << match.score
+                    << ", imageSimilarity is " << expected << endl;
+                ok = false;
+            }
+        }
+        // searchBatched 应找到查询图像本身，extract 取出的块解密后与原图一致
+        string found_path;
+        vector<Ciphertext> found;
+        double count_time = 0;
+        searchBatched(cryptor, candidates[q], pixels, batches, found_path, found, count_time);
+        vector<vector<double>> decrypted;
+        cryptor.dec_image_tiled(found, found.size(), pixels, decrypted);
+        if (found_path != paths[q] || found.empty() || !equalImage(paths[q], decrypted)) {
+            cerr << "Error: searchBatched of " << paths[q] << " found " << (found_path.empty() ? "nothing" : found_path)
+                << (found_path == paths[q] ? " but the extracted image differs" : "") << endl;
+            ok = false;
+        }
+    }
+    error_code ignored;
+    for (const string& path : paths) {
+        remove(path, ignored);
+    }
+    return ok;
+}
+size_t steadyStateAllocations(const CKKS& cryptor, const vector<Ciphertext>& ciphers, size_t rounds) {
+    CKKS::Worker worker(cryptor);
+    double norm = 0;
+    for (const Ciphertext& cipher : ciphers) {
+        norm += cryptor.selfDot(cipher);
+    }
+    // 预热：第一次调用时 Worker 的内存池和临时对象按需分配
+    for (int i = 0; i < 2; i++) {
+        worker.imageSimilarity(ciphers, ciphers, norm, norm);
+    }
+    size_t warm = worker.allocatedBytes();
+    for (size_t i = 0; i < rounds; i++) {
+        worker.imageSimilarity(ciphers, ciphers, norm, norm);
+    }
+    return worker.allocatedBytes() - warm;
 }
\ No newline at end of file